@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <threadutil/atomic_lock.h>
+#include <threadutil/atomic_rw_lock.h>
+#include <threadutil/atomic_br_lock.h>
+#include <threadutil/seq_lock.h>
+#include <threadutil/event_loop.h>
+#include <threadutil/event_loop_group.h>
+#include <threadutil/event_receiver.h>
+#include <threadutil/shared_singleton.h>
+#include <threadutil/clh_lock.h>
+
+// Results are written as CSV, one measurement per line, so runs of different releases can be compared by a script
+// Columns are benchmark,variant,threads,metric,value,unit. Lines starting with # are comments
+void report(const char *benchmark, const char *variant, int threads, const char *metric, double value, const char *unit)
+{
+	printf("%s,%s,%i,%s,%.3f,%s\n", benchmark, variant, threads, metric, value, unit);
+	fflush(stdout);
+}
+
+// Value at the given quantile of sorted samples
+int64_t percentile(const std::vector<int64_t> &sorted, double quantile)
+{
+	if (sorted.empty())
+		return 0;
+	size_t i = (size_t)(quantile * (double)sorted.size());
+	return sorted[std::min(i, sorted.size() - 1)];
+}
+
+inline int64_t nanoseconds(const std::chrono::steady_clock::duration &duration)
+{
+	return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+// Runs body(thread, count) in a loop on every thread for the duration, where count is the number of operations that thread did so far
+// Returns the total operations per second, and the operations of each thread in counts if given
+template<class TBody>
+double runWorkers(int threads, std::chrono::milliseconds duration, const TBody &body, std::vector<uint64_t> *counts = NULL)
+{
+	std::atomic_bool start(false);
+	std::atomic_bool stop(false);
+	std::vector<uint64_t> padded(threads * 8); // Spaced out to avoid false sharing
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; ++i)
+	{
+		workers.push_back(std::thread([&, i]() -> void {
+			uint64_t count = 0;
+			while (!start.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				body(i, count);
+				++count;
+			}
+			padded[i * 8] = count;
+		}));
+	}
+	start.store(true, std::memory_order_release);
+	std::this_thread::sleep_for(duration);
+	stop.store(true, std::memory_order_relaxed);
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+
+	uint64_t total = 0;
+	if (counts)
+		counts->resize(threads);
+	for (int i = 0; i < threads; ++i)
+	{
+		total += padded[i * 8];
+		if (counts)
+			(*counts)[i] = padded[i * 8];
+	}
+	return (double)total / std::chrono::duration<double>(duration).count();
+}
+
+// Lock contention: every thread repeatedly takes the lock for a short critical section
+// Reports total throughput, and fairness as the spread between the least and most successful thread
+template<class TLock>
+void lockBench(const char *name, int threads, std::chrono::milliseconds duration)
+{
+	TLock lock;
+	volatile uint64_t shared = 0;
+	std::vector<uint64_t> counts;
+	double throughput = runWorkers(threads, duration, [&](int, uint64_t) -> void {
+		lock.lock();
+		shared = shared + 1;
+		lock.unlock();
+	}, &counts);
+
+	uint64_t least = ~0ULL, most = 0;
+	for (int i = 0; i < threads; ++i)
+	{
+		least = std::min(least, counts[i]);
+		most = std::max(most, counts[i]);
+	}
+	report("lock", name, threads, "throughput", throughput, "ops/s");
+	report("lock", name, threads, "fairness", most ? (double)least / (double)most : 1.0, "least/most");
+}
+
+// Read-mostly contention: every thread reads under the lock, and one in every writeEvery operations is a write
+template<class TLock>
+void readBench(const char *benchmark, const char *name, int threads, int writeEvery, std::chrono::milliseconds duration)
+{
+	TLock lock;
+	volatile uint64_t shared = 0;
+	double throughput = runWorkers(threads, duration, [&](int, uint64_t count) -> void {
+		if (writeEvery && (count % writeEvery) == (uint64_t)writeEvery - 1)
+		{
+			lock.lockWrite();
+			shared = shared + 1;
+			lock.unlockWrite();
+		}
+		else
+		{
+			lock.lockRead();
+			uint64_t value = shared;
+			(void)value;
+			lock.unlockRead();
+		}
+	});
+	report(benchmark, name, threads, "throughput", throughput, "ops/s");
+}
+
+struct SnapshotData
+{
+	uint64_t A, B, C, D;
+};
+
+// SeqLock wrapper for snapshotBench
+struct SnapshotSeqLock
+{
+public:
+	inline void write(uint64_t v) { SnapshotData data = { v, v, v, v }; m_Lock.store(data); }
+	inline SnapshotData read() { return m_Lock.load(); }
+
+private:
+	SeqLock<SnapshotData> m_Lock;
+
+};
+
+// AtomicRWLock wrapper for snapshotBench
+struct SnapshotRWLock
+{
+public:
+	inline SnapshotRWLock() { m_Data.A = m_Data.B = m_Data.C = m_Data.D = 0; }
+	inline void write(uint64_t v) { m_Lock.lockWrite(); m_Data.A = m_Data.B = m_Data.C = m_Data.D = v; m_Lock.unlockWrite(); }
+	inline SnapshotData read() { m_Lock.lockRead(); SnapshotData data = m_Data; m_Lock.unlockRead(); return data; }
+
+private:
+	AtomicRWLock m_Lock;
+	SnapshotData m_Data;
+
+};
+
+// Snapshot reads: one thread keeps writing a small struct while the other threads read consistent copies of it
+template<class TSnapshot>
+void snapshotBench(const char *name, int readers, std::chrono::milliseconds duration)
+{
+	TSnapshot snapshot;
+	std::atomic<uint64_t> torn(0);
+	std::vector<uint64_t> counts;
+	runWorkers(readers + 1, duration, [&](int thread, uint64_t count) -> void {
+		if (!thread)
+		{
+			snapshot.write(count + 1); // Thread 0 is the writer
+			return;
+		}
+		SnapshotData data = snapshot.read();
+		if (data.A != data.B || data.A != data.C || data.A != data.D)
+			++torn;
+	}, &counts);
+
+	uint64_t reads = 0;
+	for (int i = 1; i <= readers; ++i)
+		reads += counts[i];
+	double seconds = std::chrono::duration<double>(duration).count();
+	report("snapshot", name, readers, "reads", (double)reads / seconds, "ops/s");
+	report("snapshot", name, readers, "writes", (double)counts[0] / seconds, "ops/s");
+	report("snapshot", name, readers, "torn", (double)torn.load(), "reads");
+}
+
+// Receiver churn: every thread creates a receiver, copies its handle, checks it, and destroys the receiver
+void receiverBench(int threads, std::chrono::milliseconds duration)
+{
+	EventLoop loop;
+	double throughput = runWorkers(threads, duration, [&](int, uint64_t) -> void {
+		EventReceiverHandle handle;
+		; {
+			EventReceiver receiver(&loop);
+			handle = receiver.eventReceiverHandle();
+			if (!handle.alive())
+				printf("Receiver handle should be alive, there's an issue\n");
+		}
+		if (handle.alive())
+			printf("Receiver handle should be dead, there's an issue\n");
+	});
+	report("receiver", "EventReceiver", threads, "throughput", throughput, "receivers/s");
+}
+
+// Post throughput: producers post a fixed number of empty functions to one loop, timed until the loop ran all of them
+void postBench(int producers, int total)
+{
+	EventLoop loop;
+	loop.run();
+	uint64_t executed = 0; // Loop thread only
+	int each = total / producers;
+	std::atomic_bool start(false);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < producers; ++i)
+	{
+		workers.push_back(std::thread([&]() -> void {
+			while (!start.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			for (int j = 0; j < each; ++j)
+			{
+				loop.immediate([&executed]() -> void {
+					++executed;
+				});
+			}
+		}));
+	}
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	start.store(true, std::memory_order_release);
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	loop.join(); // Queued behind every post
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	loop.stop();
+
+	if (executed != (uint64_t)each * producers)
+		printf("# post: ran %llu of %llu functions, there's an issue\n", (unsigned long long)executed, (unsigned long long)each * producers);
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	report("post", "immediate", producers, "throughput", (double)executed / seconds, "posts/s");
+}
+
+// Post to run latency: one producer posts bursts of functions and waits for each burst to run. A burst of one measures an idle loop
+void latencyBench(const char *variant, int burst, int samples)
+{
+	EventLoop loop;
+	loop.run();
+	std::vector<int64_t> latencies; // Loop thread only until the end
+	latencies.reserve(samples);
+	std::atomic_int done(0);
+	for (int s = 0; s < samples; s += burst)
+	{
+		int n = std::min(burst, samples - s);
+		for (int i = 0; i < n; ++i)
+		{
+			std::chrono::steady_clock::time_point posted = std::chrono::steady_clock::now();
+			loop.immediate([&latencies, &done, posted]() -> void {
+				latencies.push_back(nanoseconds(std::chrono::steady_clock::now() - posted));
+				done.fetch_add(1, std::memory_order_release);
+			});
+		}
+		while (done.load(std::memory_order_acquire) < s + n)
+			std::this_thread::yield();
+	}
+	loop.stop();
+
+	std::sort(latencies.begin(), latencies.end());
+	report("latency", variant, 1, "p50", (double)percentile(latencies, 0.5), "ns");
+	report("latency", variant, 1, "p90", (double)percentile(latencies, 0.9), "ns");
+	report("latency", variant, 1, "p99", (double)percentile(latencies, 0.99), "ns");
+	report("latency", variant, 1, "p999", (double)percentile(latencies, 0.999), "ns");
+	report("latency", variant, 1, "max", latencies.empty() ? 0.0 : (double)latencies.back(), "ns");
+}
+
+// Timers: insert a fixed number of timeouts spread over the next minute and cancel them again, then fire a batch that is due at once
+void timerBench(int count)
+{
+	EventLoop loop;
+	loop.run();
+	std::vector<EventTimer> timers(count);
+	uint32_t seed = 12345; // Same delays on every run
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; ++i)
+	{
+		seed = seed * 1664525 + 1013904223;
+		timers[i] = loop.timeout([]() -> void { }, std::chrono::milliseconds(1000 + (seed >> 16) % 59000));
+	}
+	std::chrono::steady_clock::time_point inserted = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; ++i)
+	{
+		if (!loop.clear(timers[i]))
+			printf("# timer: cancel failed, there's an issue\n");
+	}
+	std::chrono::steady_clock::time_point cancelled = std::chrono::steady_clock::now();
+	report("timer", "timeout", 1, "insert", (double)count / std::chrono::duration<double>(inserted - begin).count(), "timers/s");
+	report("timer", "timeout", 1, "cancel", (double)count / std::chrono::duration<double>(cancelled - inserted).count(), "timers/s");
+
+	int fired = 0; // Loop thread only
+	std::chrono::steady_clock::time_point first, last;
+	std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+	for (int i = 0; i < count; ++i)
+	{
+		loop.timed([&fired, &first, &last]() -> void {
+			last = std::chrono::steady_clock::now();
+			if (!fired++)
+				first = last;
+		}, due);
+	}
+	std::this_thread::sleep_until(due + std::chrono::milliseconds(10));
+	loop.join(true);
+	loop.stop();
+	if (fired != count)
+		printf("# timer: fired %i of %i timers, there's an issue\n", fired, count);
+	else
+		report("timer", "timeout", 1, "fire", (double)count / std::chrono::duration<double>(last - first).count(), "timers/s");
+}
+
+class BenchSingleton : public SharedSingleton<BenchSingleton>
+{
+
+};
+
+// Singleton access: every thread keeps taking and dropping an instance. When held, another reference keeps the instance alive, otherwise it is created and destroyed each time
+void singletonBench(const char *variant, bool held, int threads, std::chrono::milliseconds duration)
+{
+	SharedSingleton<BenchSingleton>::Instance holder;
+	if (held)
+		holder = BenchSingleton::instance();
+	double throughput = runWorkers(threads, duration, [&](int, uint64_t) -> void {
+		SharedSingleton<BenchSingleton>::Instance instance = BenchSingleton::instance();
+		if (!instance.pointer())
+			printf("# singleton: no instance, there's an issue\n");
+	});
+	report("singleton", variant, threads, "throughput", throughput, "calls/s");
+	report("singleton", variant, threads, "cost", throughput ? threads * 1e9 / throughput : 0.0, "ns/call");
+}
+
+struct BenchEmitter : EventReceiver
+{
+public:
+	BenchEmitter(EventLoop *loop) : EventReceiver(loop) { }
+	void emit(int value) { onValue(value); }
+	EventCallback<BenchEmitter, int> onValue;
+};
+
+// Callback fan-out: subscribers spread over a number of loops, timed until every emit reached every subscriber
+void callbackBench(int loops, int subscribers, int emits)
+{
+	EventLoopGroup group(loops, false);
+	group.run();
+	std::vector<uint64_t> counts(loops * 8); // Each counter is only touched by its own loop
+	BenchEmitter emitter(&group[0]);
+	std::vector<std::unique_ptr<EventReceiver> > receivers;
+	for (int i = 0; i < subscribers; ++i)
+	{
+		int l = i % loops;
+		receivers.push_back(std::unique_ptr<EventReceiver>(new EventReceiver(&group[l])));
+		emitter.onValue(receivers.back().get(), [&counts, l](int) -> void {
+			++counts[l * 8];
+		});
+	}
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < emits; ++i)
+		emitter.emit(i);
+	group.join();
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	group.stop();
+
+	uint64_t delivered = 0;
+	for (int l = 0; l < loops; ++l)
+		delivered += counts[l * 8];
+	if (delivered != (uint64_t)emits * subscribers)
+		printf("# callback: delivered %llu of %llu calls, there's an issue\n", (unsigned long long)delivered, (unsigned long long)emits * subscribers);
+	char variant[64];
+	snprintf(variant, sizeof(variant), "subscribers=%i", subscribers);
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	report("callback", variant, loops, "emits", (double)emits / seconds, "emits/s");
+	report("callback", variant, loops, "deliveries", (double)delivered / seconds, "calls/s");
+}
+
+// Benchmarks named on the command line run, or all of them when none are named
+bool selected(int argc, char **argv, const char *benchmark)
+{
+	bool any = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (argv[i][0] == '-')
+			continue;
+		any = true;
+		if (!strcmp(argv[i], benchmark))
+			return true;
+	}
+	return !any;
+}
+
+// Usage: threadutilbench [--duration=ms] [benchmark ...]
+// Benchmarks are post, latency, timer, lock, read, readmostly, snapshot, singleton, callback and receiver
+int main(int argc, char **argv)
+{
+	std::chrono::milliseconds duration(250); // Run time of each timed case
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strncmp(argv[i], "--duration=", 11))
+			duration = std::chrono::milliseconds(atoi(argv[i] + 11));
+	}
+
+	printf("# threadutilbench, %u hardware threads, %lli ms per timed case\n", std::thread::hardware_concurrency(), (long long)duration.count());
+	printf("benchmark,variant,threads,metric,value,unit\n");
+
+	if (selected(argc, argv, "post"))
+	{
+		for (int producers = 1; producers <= 64; producers *= 2)
+			postBench(producers, 1 << 20);
+	}
+
+	if (selected(argc, argv, "latency"))
+	{
+		latencyBench("burst=1", 1, 20000);
+		latencyBench("burst=100", 100, 100000);
+	}
+
+	if (selected(argc, argv, "timer"))
+		timerBench(100000);
+
+	if (selected(argc, argv, "lock"))
+	{
+		for (int threads = 1; threads <= 64; threads *= 2)
+		{
+			lockBench<AtomicLock>("AtomicLock", threads, duration);
+			lockBench<ClhLock>("ClhLock", threads, duration);
+			lockBench<std::mutex>("std::mutex", threads, duration);
+		}
+	}
+
+	if (selected(argc, argv, "read"))
+	{
+		for (int threads = 1; threads <= 64; threads *= 2)
+		{
+			readBench<AtomicRWLock>("read", "AtomicRWLock", threads, 0, duration);
+			readBench<AtomicBRLock>("read", "AtomicBRLock", threads, 0, duration);
+		}
+	}
+
+	if (selected(argc, argv, "readmostly"))
+	{
+		for (int threads = 1; threads <= 64; threads *= 2)
+		{
+			readBench<AtomicRWLock>("readmostly", "AtomicRWLock", threads, 1000, duration);
+			readBench<AtomicBRLock>("readmostly", "AtomicBRLock", threads, 1000, duration);
+		}
+	}
+
+	if (selected(argc, argv, "snapshot"))
+	{
+		for (int readers = 1; readers <= 64; readers *= 2)
+		{
+			snapshotBench<SnapshotRWLock>("AtomicRWLock", readers, duration);
+			snapshotBench<SnapshotSeqLock>("SeqLock", readers, duration);
+		}
+	}
+
+	if (selected(argc, argv, "singleton"))
+	{
+		for (int threads = 1; threads <= 16; threads *= 4)
+		{
+			singletonBench("held", true, threads, duration);
+			singletonBench("created", false, threads, duration);
+		}
+	}
+
+	if (selected(argc, argv, "callback"))
+	{
+		for (int loops = 1; loops <= 4; loops *= 2)
+		{
+			callbackBench(loops, 1, 100000);
+			callbackBench(loops, 16, 20000);
+			callbackBench(loops, 256, 2000);
+		}
+	}
+
+	if (selected(argc, argv, "receiver"))
+	{
+		for (int threads = 1; threads <= 16; threads *= 4)
+			receiverBench(threads, duration);
+	}
+
+	return 0;
+}
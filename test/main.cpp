@@ -1,7 +1,14 @@
 #include <stdio.h>
 
 #include <threadutil/event_loop.h>
+#include <threadutil/event_loop_group.h>
+#include <threadutil/work_stealing_executor.h>
 #include <threadutil/async.h>
+#include <threadutil/future.h>
+#include <threadutil/event_coroutine.h>
+#include <threadutil/async_lock.h>
+#include <threadutil/async_semaphore.h>
+#include <threadutil/async_rw_lock.h>
 #include <threadutil/event_receiver.h>
 #include <threadutil/shared_singleton.h>
 
@@ -51,6 +58,25 @@ public:
 	~neato() { printf("Neato destructor.\n"); }
 };
 
+#ifdef __cpp_impl_coroutine
+EventCoroutine coroutineTest(EventLoop &e, EventLoop &other, AsyncLock &lock, const EventReceiver *receiver)
+{
+	co_await e.sleep(std::chrono::milliseconds(100));
+	co_await lock.lock(receiver);
+	printf("Coroutine holds the async lock\n");
+	lock.unlock();
+	co_await other.schedule();
+	Promise<int> promise(other);
+	other.immediate([&promise]() -> void {
+		promise.setValue(42);
+	});
+	int value = co_await promise.future();
+	printf("Coroutine switched loops, received %i\n", value);
+	co_await e.schedule();
+	printf("Coroutine back on the first loop\n");
+}
+#endif
+
 int main()
 {
 	EventLoop e;
@@ -92,6 +118,13 @@ int main()
 		return;
 	});
 
+	e.immediate([]() -> void {
+		printf("Background priority, after high priority\n");
+	}, EventPriority::Background);
+	e.immediate([]() -> void {
+		printf("High priority\n");
+	}, EventPriority::High);
+
 	e.interval([&e]() -> void {
 		printf("once\n");
 		e.cancel();
@@ -103,8 +136,8 @@ int main()
 	e.timeout([]() -> void {
 		printf("1\n");
 	}, std::chrono::milliseconds(1000));
-	/* int three = */ e.timeout([]() -> void {
-		printf("3\n");
+	EventTimer three = e.timeout([]() -> void {
+		printf("3 should have been cleared, there's an issue\n");
 	}, std::chrono::milliseconds(3000));
 	e.timeout([]() -> void {
 		printf("2\n");
@@ -114,7 +147,17 @@ int main()
 		e.stop();
 	}, std::chrono::milliseconds(4000));
 
-	// e.clear(three);
+	if (!e.clear(three)) printf("Timer three should be cleared, there's an issue\n");
+	if (e.clear(three)) printf("Timer three was already cleared, there's an issue\n");
+
+	; {
+		EventLoop cleared;
+		EventTimer stale = cleared.timeout([]() -> void { }, std::chrono::milliseconds(1000));
+		cleared.clear();
+		EventTimer fresh = cleared.timeout([]() -> void { }, std::chrono::milliseconds(1000));
+		if (stale == fresh || cleared.clear(stale)) printf("Timer handle from before clear matches a new timer, there's an issue\n");
+		if (!cleared.clear(fresh)) printf("Timer created after clear should be cleared, there's an issue\n");
+	}
 
 	AsyncParallel ap(e);
 	ap.call([&e](std::function<void()> callback) -> void {
@@ -140,6 +183,103 @@ int main()
 		return;
 	});
 
+	e.thread([]() -> void {
+		printf("Blocking work on the thread pool\n");
+	}, [&e]() -> void {
+		ThreadPoolStats stats = e.threadPool().stats();
+		printf("Blocking work callback, %i thread(s) in pool\n", (int)stats.Threads);
+	});
+
+	AsyncLock asyncLock;
+	EventReceiver lockReceiver(&e);
+	asyncLock.lock(&lockReceiver, [&e, &asyncLock]() -> void {
+		printf("Async lock first\n");
+		e.immediate([&asyncLock]() -> void {
+			asyncLock.unlock();
+		});
+	});
+	; {
+		EventReceiver deadReceiver(&e);
+		asyncLock.lock(&deadReceiver, []() -> void {
+			printf("Async lock receiver is dead, should not show up\n");
+		});
+	}
+	asyncLock.lock(&lockReceiver, [&asyncLock]() -> void {
+		printf("Async lock second\n");
+		asyncLock.unlock();
+	});
+
+	AsyncSemaphore asyncSemaphore(2);
+	std::atomic_int inFlight(0);
+	for (int i = 0; i < 4; ++i)
+	{
+		asyncSemaphore.acquire(&lockReceiver, [&e, &asyncSemaphore, &inFlight]() -> void {
+			int n = ++inFlight;
+			if (n > 2) printf("Async semaphore let %i through, there's an issue\n", n);
+			e.immediate([&asyncSemaphore, &inFlight]() -> void {
+				--inFlight;
+				asyncSemaphore.release();
+			});
+		});
+	}
+	asyncSemaphore.acquire(&lockReceiver, [&asyncSemaphore]() -> void {
+		printf("Async semaphore acquired 2 permits\n");
+		asyncSemaphore.release(2);
+	}, 2);
+	if (asyncSemaphore.acquire(&lockReceiver, []() -> void { }, 3)) printf("Async semaphore accepted more permits than it holds, there's an issue\n");
+
+	AsyncRWLock asyncRWLock;
+	asyncRWLock.lockRead(&lockReceiver, [&asyncRWLock]() -> void {
+		printf("Async read lock\n");
+		asyncRWLock.unlockRead();
+	});
+	asyncRWLock.lockWrite(&lockReceiver, [&asyncRWLock]() -> void {
+		printf("Async write lock, after read\n");
+		asyncRWLock.unlockWrite();
+	});
+
+	Promise<int> promise(e);
+	Future<void> resolved = promise.future().then([](int v) -> int {
+		return v + 1;
+	}).then([](int v) -> void {
+		printf("Future resolved %i\n", v);
+	});
+	std::vector<Future<int> > futures;
+	Promise<int> first(e), second(e);
+	futures.push_back(first.future());
+	futures.push_back(second.future());
+	Future<void> joined = whenAll(e, std::move(futures)).then([](std::vector<int> values) -> void {
+		printf("Futures joined %i %i\n", values[0], values[1]);
+	});
+	e.immediate([&promise, &first, &second]() -> void {
+		promise.setValue(41);
+		second.setValue(2);
+		first.setValue(1);
+	});
+	; {
+		std::shared_ptr<int> token = std::make_shared<int>(0);
+		; {
+			Promise<int> abandoned(e);
+			Future<void> pending = abandoned.future().then([token](int) -> void {
+				printf("Continuation of an abandoned promise ran, there's an issue\n");
+			});
+			std::vector<Future<int> > racing;
+			Promise<int> left(e), right(e);
+			racing.push_back(left.future());
+			racing.push_back(right.future());
+			Future<void> any = whenAny(e, std::move(racing)).then([token](std::pair<size_t, int>) -> void {
+				printf("Continuation of abandoned futures ran, there's an issue\n");
+			});
+		}
+		if (token.use_count() != 1) printf("Continuations of abandoned promises were not destroyed, there's an issue\n");
+	}
+
+#ifdef __cpp_impl_coroutine
+	EventLoop other;
+	other.run();
+	coroutineTest(e, other, asyncLock, &lockReceiver);
+#endif
+
 	printf("Create tester t\n");
 	tester *tp = new tester(&e);
 
@@ -169,5 +309,82 @@ int main()
 
 	e.runSync();
 
+	BlockPoolStats poolStats = e.blockPool().stats();
+	if (poolStats.Allocated > poolStats.Capacity) printf("Block pool handed out more than it carved, there's an issue\n");
+	printf("Block pool carved %i blocks in %i chunks\n", (int)poolStats.Capacity, (int)poolStats.Chunks);
+
+#ifdef EVENT_LOOP_METRICS
+	EventLoopStats loopStats = e.stats();
+	if (loopStats.Posted != loopStats.Executed) printf("Event loop ran %i of %i posted functions, there's an issue\n", (int)loopStats.Executed, (int)loopStats.Posted);
+	printf("Event loop latency p50 %i ns, p99 %i ns, run time p99 %i ns, timer lateness p99 %i us\n",
+		(int)loopStats.Latency.percentile(0.5), (int)loopStats.Latency.percentile(0.99),
+		(int)loopStats.RunTime.percentile(0.99), (int)(loopStats.Lateness.percentile(0.99) / 1000));
+#endif
+
+	EventLoopGroup group(2);
+	group.run();
+	std::atomic_int reached(0);
+	if (&group[0].threadPool() != &group[1].threadPool()) printf("Loops in a group should share one thread pool, there's an issue\n");
+	group.broadcast([&reached]() -> void {
+		++reached;
+	});
+	group.next().immediate([&reached]() -> void {
+		++reached;
+	});
+	AsyncParallel fanIn(group[0]); // Branches finish on the first loop, completion is posted to the last loop
+	for (int i = 0; i < 4; ++i)
+	{
+		fanIn.call([&group](std::function<void()> callback) -> void {
+			group[0].immediate(callback);
+		});
+	}
+	fanIn.completed(group[group.size() - 1], []() -> void {
+		printf("Async parallel joined across loops\n");
+	});
+	group.join();
+	printf("Event loop group reached %i\n", reached.load());
+	; {
+		// Both loops are stuck in a long function, the one with the larger backlog must not be picked
+		std::atomic_bool stalled(true);
+		for (int l = 0; l < 2; ++l)
+		{
+			group[l].immediate([&stalled]() -> void {
+				while (stalled)
+					std::this_thread::yield();
+			});
+			for (int i = 0; i < (l ? 10 : 100); ++i)
+				group[l].immediate([]() -> void { });
+		}
+		for (int i = 0; i < 8; ++i)
+			if (&group.leastLoaded() == &group[0]) printf("Least loaded picked the loop with %i pending over %i, there's an issue\n", (int)group[0].pending(), (int)group[1].pending());
+		stalled = false;
+		group.join();
+	}
+#ifdef EVENT_LOOP_TRACE
+	if (group.dumpTrace("threadutiltest_trace.json")) printf("Event loop group trace written\n");
+#endif
+	group.stop();
+
+	WorkStealingExecutor executor(2);
+	executor.run();
+	std::atomic_int fanned(0);
+	for (int i = 0; i < 8; ++i)
+	{
+		executor.immediate([&executor, &fanned]() -> void {
+			executor.immediate([&fanned]() -> void {
+				++fanned;
+			});
+		});
+	}
+	executor.join();
+	printf("Work stealing executor ran %i\n", fanned.load());
+	executor.stop();
+
+	; {
+		WorkStealingExecutor stopped(1);
+		stopped.immediate([]() -> void { });
+		stopped.join(); // Returns right away, the queued function can only run once the executor runs
+	}
+
 	return 0;
 }
@@ -1,53 +1,65 @@
-
 #include <functional>
 #include <atomic>
+#include <memory>
+
+#include "event_loop.h"
 
 class Async
 {
 private:
+	//! Starts with one count held by parallel itself, which is only released once every branch has been started
+	//! Whichever thread releases the last count runs the callback and deletes the state, so branches only carry a raw pointer
 	struct parallel_state
 	{
+		parallel_state() : remaining(1) { }
 		std::function<void()> callback;
-		int remaining;
+		std::atomic_int remaining;
 	};
 
+	inline static void parallelrelease(parallel_state *state)
+	{
+		if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			if (state->callback)
+				state->callback();
+			delete state;
+		}
+	}
+
 	template<typename Tf>
-	inline static void parallelsub(std::shared_ptr<parallel_state> state, Tf f)
+	inline static void parallelsub(parallel_state *state, Tf f)
 	{
-		if (state->remaining)
-			state->callback = f;
-		else if (!state->callback)
-			f();
+		state->callback = f;
+		parallelrelease(state);
 	}
 
 	template<typename Tf, typename... Tfv>
-	inline static void parallelsub(std::shared_ptr<parallel_state> state, Tf f, Tfv... fv)
+	inline static void parallelsub(parallel_state *state, Tf f, Tfv... fv)
 	{
-		++state->remaining;
+		state->remaining.fetch_add(1, std::memory_order_relaxed);
 		f([state]() -> void {
-			--state->remaining;
-			if (!state->remaining && state->callback)
-				state->callback();
+			parallelrelease(state);
 		});
 		parallelsub(state, fv...);
 	}
 
 public:
+	//! Calls every function but the last one with a callback, and calls the last one once all callbacks have been called
+	//! Callbacks may be called from any thread, the last function runs on the thread that calls the final callback
 	template<typename... Tfv>
-	void static parallel(Tfv... fv) // only call from event loop itself
+	void static parallel(Tfv... fv) // thread-safe
 	{
-		std::shared_ptr<parallel_state> state = std::shared_ptr<parallel_state>(new parallel_state());
-		state->remaining = 0;
-		parallelsub(state, fv...);
+		parallelsub(new parallel_state(), fv...);
 	}
 
 };
 
-// Not thread safe (yet)
+//! Joins a number of calls, callbacks may be called from any thread
+//! Don't start new calls after completed has been set, until the completion has run
 class AsyncParallel
 {
 public:
-	AsyncParallel(EventLoop &e) : m_EventLoop(e), m_Remaining(0)
+	AsyncParallel(EventLoop &e) : m_EventLoop(e), m_Remaining(1), m_Target(NULL)
 	{
 
 	}
@@ -55,48 +67,62 @@ public:
 	template<typename TFunc>
 	inline void call(TFunc f)
 	{
-		++m_Remaining;
+		m_Remaining.fetch_add(1, std::memory_order_relaxed);
 		f([this]() -> void {
-			--m_Remaining;
-			if (!m_Remaining && m_Completed)
-			{
-				m_Completed();
-				m_Completed = std::function<void()>();
-			}
+			release();
 		});
 	}
 
 	template<typename TFunc>
 	inline void defer(TFunc f)
 	{
-		++m_Remaining;
+		m_Remaining.fetch_add(1, std::memory_order_relaxed);
 		m_EventLoop.immediate([this, f]() -> void {
 			f([this]() -> void {
-				--m_Remaining;
-				if (!m_Remaining && m_Completed)
-				{
-					m_Completed();
-					m_Completed = std::function<void()>();
-				}
+				release();
 			});
 		});
 	}
 
+	//! Runs f on the thread that makes the last callback, or right away if all calls are done
 	template<typename TFunc>
 	inline void completed(TFunc f)
 	{
-		if (m_Remaining)
-			m_Completed = f;
-		else if (!m_Completed)
-			f();
+		m_Completed = f;
+		m_Target = NULL;
+		release(); // Release the count held until completion is known
+	}
+
+	//! Posts f to the given event loop once all calls are done
+	template<typename TFunc>
+	inline void completed(EventLoop &loop, TFunc f)
+	{
+		m_Completed = f;
+		m_Target = &loop;
+		release();
 	}
 
 private:
-	std::function<void()> m_Completed;
-	int m_Remaining;
+	void release()
+	{
+		if (m_Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			std::function<void()> completed;
+			completed.swap(m_Completed);
+			EventLoop *target = m_Target;
+			m_Remaining.store(1, std::memory_order_relaxed); // Ready for the next round of calls
+			if (target)
+				target->immediate(completed);
+			else if (completed)
+				completed();
+		}
+	}
+
 	EventLoop &m_EventLoop;
+	std::atomic_int m_Remaining;
+	std::function<void()> m_Completed;
+	EventLoop *m_Target;
 
 };
 
 /* end of file */
-
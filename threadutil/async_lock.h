@@ -30,52 +30,68 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define THREADUTIL_ASYNC_LOCK_H
 
 #include <atomic>
-#include <concurrent_queue.h>
+#include <thread>
 
 #include "event_receiver.h"
+#include "mpsc_queue.h"
 
 //! Asynchronous locking mechanism which puts the provided function into the event loop as soon as the lock is available
+//! The lock is handed directly to the next waiter in FIFO order on unlock, waiters whose receiver is gone are skipped
 class AsyncLock
 {
 public:
-	inline AsyncLock()
+	inline AsyncLock() : m_Count(0)
 	{
-		m_Atomic.clear();
+
 	}
 
-	inline void lock(const EventReceiver *receiver, EventFunction f)
+	inline void lock(const EventReceiver *receiver, EventFunction f) // thread-safe
 	{
 		m_Queue.push(EventReceiverFunction(receiver, f));
-		progress();
+		if (m_Count.fetch_add(1, std::memory_order_acq_rel) == 0)
+			dispatch(); // Lock was free, this call now owns it
 	}
 
-	inline void unlock()
+#ifdef __cpp_impl_coroutine
+	struct LockAwaiter
+	{
+	public:
+		inline bool await_ready() const { return false; }
+		inline void await_suspend(std::coroutine_handle<> handle) { Lock->lock(Receiver, [handle]() -> void { handle.resume(); }); }
+		inline void await_resume() const { }
+		AsyncLock *Lock;
+		const EventReceiver *Receiver;
+	};
+
+	//! co_await lock.lock(receiver) continues the coroutine on the receiver's loop once the lock is held, call unlock() when done
+	inline LockAwaiter lock(const EventReceiver *receiver) { LockAwaiter res; res.Lock = this; res.Receiver = receiver; return res; }
+#endif
+
+	//! Call from the function that holds the lock, passes the lock on to the next waiter
+	inline void unlock() // thread-safe
 	{
-		m_Atomic.clear();
-		progress();
+		if (m_Count.fetch_sub(1, std::memory_order_acq_rel) > 1)
+			dispatch();
 	}
 
 private:
-	inline void progress()
+	//! Only called by the current owner, so there is only ever one consumer of the queue
+	inline void dispatch()
 	{
-		if (!m_Atomic.test_and_set())
+		for (;;)
 		{
 			EventReceiverFunction f;
-			if (m_Queue.try_pop(f))
-				f.immediate();
-			else
-			{
-				m_Atomic.clear();
-				if (!m_Queue.empty())
-				{
-					progress();
-				}
-			}
+			while (!m_Queue.tryPop(f))
+				std::this_thread::yield(); // An earlier producer is halfway through its push
+			if (f.immediate())
+				return; // Ownership passed on
+			if (m_Count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				return; // Receiver was gone and nobody else is waiting
 		}
 	}
 
-	std::atomic_flag m_Atomic;
-	concurrency::concurrent_queue<EventReceiverFunction> m_Queue;
+	std::atomic_int m_Count; // Owner plus waiters
+	MpscQueue<EventReceiverFunction> m_Queue;
 
 	AsyncLock &operator=(const AsyncLock&) = delete;
 	AsyncLock(const AsyncLock&) = delete;
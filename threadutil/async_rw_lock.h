@@ -0,0 +1,127 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_ASYNC_RW_LOCK_H
+#define THREADUTIL_ASYNC_RW_LOCK_H
+
+#include <deque>
+#include <mutex>
+
+#include "event_receiver.h"
+
+//! Asynchronous lock allowing one writer or multiple readers, puts the provided function into the event loop as soon as the lock is available
+//! Waiters are served in FIFO order, so readers arriving after a waiting writer queue behind it. Waiters whose receiver is gone are skipped
+//! Functions are posted under the lock, so they are posted in the same order as the lock is granted
+class AsyncRWLock
+{
+public:
+	inline AsyncRWLock() : m_Reading(0), m_Writing(false)
+	{
+
+	}
+
+	inline void lockRead(const EventReceiver *receiver, EventFunction f) // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		if (m_Writing || !m_Waiters.empty())
+		{
+			m_Waiters.push_back(Waiter(EventReceiverFunction(receiver, f), false));
+			return;
+		}
+		if (receiver->eventReceiverHandle().immediate(f))
+			++m_Reading;
+	}
+
+	inline void lockWrite(const EventReceiver *receiver, EventFunction f) // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		if (m_Writing || m_Reading || !m_Waiters.empty())
+		{
+			m_Waiters.push_back(Waiter(EventReceiverFunction(receiver, f), true));
+			return;
+		}
+		if (receiver->eventReceiverHandle().immediate(f))
+			m_Writing = true;
+	}
+
+	inline void unlockRead() // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		--m_Reading;
+		grant();
+	}
+
+	inline void unlockWrite() // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		m_Writing = false;
+		grant();
+	}
+
+private:
+	struct Waiter
+	{
+	public:
+		inline Waiter() : Write(false) { }
+		inline Waiter(const EventReceiverFunction &f, bool write) : Function(f), Write(write) { }
+		EventReceiverFunction Function;
+		bool Write;
+	};
+
+	//! Grants the lock to the front waiters, either a single writer or a run of readers, call with m_Lock held
+	void grant()
+	{
+		while (!m_Waiters.empty() && !m_Writing)
+		{
+			Waiter &waiter = m_Waiters.front();
+			if (waiter.Write && m_Reading)
+				return;
+			if (waiter.Function.immediate()) // Otherwise the receiver is gone, and is not granted the lock
+			{
+				if (waiter.Write)
+					m_Writing = true;
+				else
+					++m_Reading;
+			}
+			m_Waiters.pop_front();
+		}
+	}
+
+	EventLoopLock m_Lock;
+	int m_Reading;
+	bool m_Writing;
+	std::deque<Waiter> m_Waiters;
+
+	AsyncRWLock &operator=(const AsyncRWLock&) = delete;
+	AsyncRWLock(const AsyncRWLock&) = delete;
+
+};
+
+#endif /* THREADUTIL_ASYNC_RW_LOCK_H */
+
+/* end of file */
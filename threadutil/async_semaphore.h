@@ -0,0 +1,123 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_ASYNC_SEMAPHORE_H
+#define THREADUTIL_ASYNC_SEMAPHORE_H
+
+#include <deque>
+#include <mutex>
+
+#include "event_receiver.h"
+
+//! Asynchronous counting semaphore, puts the provided function into the event loop as soon as enough permits are available
+//! Waiters are served in FIFO order, a waiter needing many permits holds back later ones. Waiters whose receiver is gone are skipped
+//! Functions are posted under the lock, so they are posted in the same order as their permits are granted
+class AsyncSemaphore
+{
+public:
+	inline AsyncSemaphore(int permits) : m_Capacity(permits), m_Available(permits)
+	{
+
+	}
+
+	//! Returns false without queueing when more permits are requested than the semaphore was created with, since they could never be granted
+	inline bool acquire(const EventReceiver *receiver, EventFunction f, int permits = 1) // thread-safe
+	{
+		if (permits > m_Capacity)
+			return false;
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		if (!m_Waiters.empty() || m_Available < permits)
+		{
+			m_Waiters.push_back(Waiter(EventReceiverFunction(receiver, f), permits));
+			return true;
+		}
+		if (receiver->eventReceiverHandle().immediate(f))
+			m_Available -= permits;
+		return true;
+	}
+
+	inline bool tryAcquire(int permits = 1) // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		if (!m_Waiters.empty() || m_Available < permits)
+			return false;
+		m_Available -= permits;
+		return true;
+	}
+
+	//! Return permits, the release of several permits at once may wake several waiters
+	inline void release(int permits = 1) // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		m_Available += permits;
+		grant();
+	}
+
+	inline int available() const // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		return m_Available;
+	}
+
+	inline int capacity() const { return m_Capacity; } // thread-safe
+
+private:
+	struct Waiter
+	{
+	public:
+		inline Waiter() : Permits(0) { }
+		inline Waiter(const EventReceiverFunction &f, int permits) : Function(f), Permits(permits) { }
+		EventReceiverFunction Function;
+		int Permits;
+	};
+
+	//! Post waiters from the front while their permits are available, call with m_Lock held
+	void grant()
+	{
+		while (!m_Waiters.empty() && m_Waiters.front().Permits <= m_Available)
+		{
+			Waiter &waiter = m_Waiters.front();
+			if (waiter.Function.immediate())
+				m_Available -= waiter.Permits; // Otherwise the receiver is gone, and keeps no permits
+			m_Waiters.pop_front();
+		}
+	}
+
+	const int m_Capacity;
+	mutable EventLoopLock m_Lock;
+	int m_Available;
+	std::deque<Waiter> m_Waiters;
+
+	AsyncSemaphore &operator=(const AsyncSemaphore&) = delete;
+	AsyncSemaphore(const AsyncSemaphore&) = delete;
+
+};
+
+#endif /* THREADUTIL_ASYNC_SEMAPHORE_H */
+
+/* end of file */
@@ -0,0 +1,148 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_ATOMIC_BR_LOCK_H
+#define THREADUTIL_ATOMIC_BR_LOCK_H
+
+#include <assert.h>
+#include <atomic>
+#include <thread>
+
+#ifndef ATOMIC_BR_LOCK_SLOTS
+#define ATOMIC_BR_LOCK_SLOTS 32
+#endif
+
+//! Big-reader lock, same interface as AtomicRWLock, for read-mostly data
+//! Readers are spread over cache line padded counters by thread, so concurrent readers don't share a cache line
+//! Unlike AtomicRWLock, a read lock must be released by the same thread that took it, since the release goes to that thread's counter
+//! Writers are more expensive, since they have to scan every reader slot
+class AtomicBRLock
+{
+public:
+	inline AtomicBRLock() : m_Writing(false)
+	{
+		for (int i = 0; i < ATOMIC_BR_LOCK_SLOTS; ++i)
+			m_Slots[i].Reading.store(0, std::memory_order_relaxed);
+	}
+
+	inline bool tryLockWrite()
+	{
+		if (m_Writing.exchange(true))
+			return false; // Already locked for write
+		for (int i = 0; i < ATOMIC_BR_LOCK_SLOTS; ++i)
+		{
+			if (m_Slots[i].Reading.load()) // Successfully locked for write, but busy read
+			{
+				m_Writing.store(false); // Unlock write
+				return false; // Already busy for read
+			}
+		}
+		return true; // Successfully locked for write and read
+	}
+
+	inline void lockWrite()
+	{
+		while (m_Writing.exchange(true))
+			std::this_thread::yield();
+		for (int i = 0; i < ATOMIC_BR_LOCK_SLOTS; ++i)
+		{
+			while (m_Slots[i].Reading.load())
+				std::this_thread::yield();
+		}
+	}
+
+	inline void unlockWrite()
+	{
+		m_Writing.store(false);
+	}
+
+	inline bool tryLockRead()
+	{
+		std::atomic_int &reading = slot();
+		reading.fetch_add(1);
+		if (m_Writing.load())
+		{
+			reading.fetch_sub(1);
+			return false;
+		}
+		return true;
+	}
+
+	inline void lockRead()
+	{
+		std::atomic_int &reading = slot();
+		reading.fetch_add(1);
+		while (m_Writing.load())
+		{
+			reading.fetch_sub(1);
+			while (m_Writing.load(std::memory_order_relaxed))
+				std::this_thread::yield();
+			reading.fetch_add(1);
+		}
+	}
+
+	//! Only call from the thread that took the read lock
+	inline void unlockRead()
+	{
+		int reading = slot().fetch_sub(1, std::memory_order_release);
+		assert(reading > 0); // Read lock released by another thread than the one that took it
+		(void)reading;
+	}
+
+private:
+	struct Slot
+	{
+	public:
+		std::atomic_int Reading;
+		char Padding[64 - sizeof(std::atomic_int)];
+	};
+
+	//! Each thread is assigned a slot round-robin the first time it reads, threads beyond the slot count share
+	static inline int slotIndex()
+	{
+		static std::atomic_int s_Next(0);
+		static thread_local int s_Index = s_Next.fetch_add(1, std::memory_order_relaxed) % ATOMIC_BR_LOCK_SLOTS;
+		return s_Index;
+	}
+
+	inline std::atomic_int &slot()
+	{
+		return m_Slots[slotIndex()].Reading;
+	}
+
+	Slot m_Slots[ATOMIC_BR_LOCK_SLOTS];
+	std::atomic_bool m_Writing;
+
+	AtomicBRLock &operator=(const AtomicBRLock&) = delete;
+	AtomicBRLock(const AtomicBRLock&) = delete;
+
+};
+
+#endif /* THREADUTIL_ATOMIC_BR_LOCK_H */
+
+/* end of file */
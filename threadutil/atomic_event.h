@@ -0,0 +1,163 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_ATOMIC_EVENT_H
+#define THREADUTIL_ATOMIC_EVENT_H
+
+#include <atomic>
+#include <chrono>
+
+#include "futex.h"
+
+#ifndef THREADUTIL_FUTEX
+#	ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#	else
+#include <mutex>
+#include <condition_variable>
+#	endif
+#endif
+
+//! Wake up event with a single waiter. Setting the event only costs a system call while the waiter is actually parked
+//! The waiter must call prepare(), then check its wake condition again, and then either cancel() or wait()
+class AtomicEvent
+{
+public:
+	inline AtomicEvent() : m_State(Awake)
+	{
+#if !defined(THREADUTIL_FUTEX) && defined(WIN32)
+		m_Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+	}
+
+	inline ~AtomicEvent()
+	{
+#if !defined(THREADUTIL_FUTEX) && defined(WIN32)
+		CloseHandle(m_Event);
+#endif
+	}
+
+	//! Announce that the waiter is about to park
+	inline void prepare()
+	{
+		m_State.store(Parked, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	//! The waiter found work after prepare()
+	inline void cancel()
+	{
+		m_State.store(Awake, std::memory_order_relaxed);
+	}
+
+	//! Park until set() is called
+	inline void wait()
+	{
+#ifdef THREADUTIL_FUTEX
+		futexWait(&m_State, Parked);
+#elif defined(WIN32)
+		WaitForSingleObject(m_Event, INFINITE);
+#else
+		; {
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			while (m_State.load(std::memory_order_relaxed) == Parked)
+				m_Cond.wait(lock);
+		}
+#endif
+		m_State.store(Awake, std::memory_order_relaxed);
+	}
+
+	//! Park until set() is called or the time point is reached
+	inline void waitUntil(const std::chrono::steady_clock::time_point &point)
+	{
+#ifdef THREADUTIL_FUTEX
+		futexWait(&m_State, Parked, point - std::chrono::steady_clock::now());
+#elif defined(WIN32)
+		std::chrono::steady_clock::duration delta = point - std::chrono::steady_clock::now();
+		if (delta > std::chrono::steady_clock::duration::zero())
+		{
+			DWORD wt = (DWORD)((std::chrono::duration_cast<std::chrono::microseconds>(delta).count() + 999) / 1000);
+			WaitForSingleObject(m_Event, wt);
+		}
+#else
+		; {
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			while (m_State.load(std::memory_order_relaxed) == Parked)
+			{
+				if (m_Cond.wait_until(lock, point) == std::cv_status::timeout)
+					break;
+			}
+		}
+#endif
+		m_State.store(Awake, std::memory_order_relaxed);
+	}
+
+	//! Wake the waiter if it is parked, thread-safe
+	inline void set()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_State.load(std::memory_order_relaxed) == Parked
+			&& m_State.exchange(Awake) == Parked)
+		{
+#ifdef THREADUTIL_FUTEX
+			futexWake(&m_State, 1);
+#elif defined(WIN32)
+			SetEvent(m_Event);
+#else
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Cond.notify_one();
+#endif
+		}
+	}
+
+private:
+	enum
+	{
+		Awake = 0,
+		Parked = 1,
+	};
+
+	std::atomic<int> m_State;
+#ifndef THREADUTIL_FUTEX
+#	ifdef WIN32
+	HANDLE m_Event;
+#	else
+	std::mutex m_Mutex;
+	std::condition_variable m_Cond;
+#	endif
+#endif
+
+	AtomicEvent &operator=(const AtomicEvent&) = delete;
+	AtomicEvent(const AtomicEvent&) = delete;
+
+};
+
+#endif /* THREADUTIL_ATOMIC_EVENT_H */
+
+/* end of file */
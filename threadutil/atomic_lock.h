@@ -32,23 +32,35 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <atomic>
 #include <thread>
 
+#include "cpu_pause.h"
+#include "futex.h"
+
+//! Spin budget, in pause instructions, before a contended lock parks the thread
+#ifndef ATOMIC_LOCK_SPIN_LIMIT
+#define ATOMIC_LOCK_SPIN_LIMIT 4096
+#endif
+
+//! Adaptive lock. Spins read-only with exponential pause backoff, then parks on a futex (or yields where there is no futex)
+//! Unlock only makes a syscall when a thread is actually parked
 class AtomicLock
 {
 public:
-	inline AtomicLock()
+	inline AtomicLock() : m_State(Unlocked)
 	{
-		m_Atomic.clear();
+
 	}
 
 	inline void lock()
 	{
-		while (m_Atomic.test_and_set())
-			std::this_thread::yield();
+		int expected = Unlocked;
+		if (!m_State.compare_exchange_strong(expected, Locked, std::memory_order_acquire, std::memory_order_relaxed))
+			lockSlow();
 	}
 
 	inline bool try_lock()
 	{
-		return !m_Atomic.test_and_set();
+		int expected = Unlocked;
+		return m_State.compare_exchange_strong(expected, Locked, std::memory_order_acquire, std::memory_order_relaxed);
 	}
 
 	inline bool tryLock()
@@ -58,11 +70,60 @@ public:
 
 	inline void unlock()
 	{
-		m_Atomic.clear();
+#ifdef THREADUTIL_FUTEX
+		if (m_State.exchange(Unlocked, std::memory_order_release) == Contended)
+			futexWake(&m_State, 1);
+#else
+		m_State.store(Unlocked, std::memory_order_release);
+#endif
 	}
 
 private:
-	std::atomic_flag m_Atomic;
+	enum
+	{
+		Unlocked = 0,
+		Locked = 1,
+		Contended = 2, // Locked, and threads may be parked
+	};
+
+	void lockSlow()
+	{
+		// Test and test-and-set, only attempt the write when the lock looks free
+		int backoff = 1;
+		for (int spin = 0; spin < ATOMIC_LOCK_SPIN_LIMIT; spin += backoff)
+		{
+			int state = m_State.load(std::memory_order_relaxed);
+			if (state == Unlocked)
+			{
+				if (m_State.compare_exchange_weak(state, Locked, std::memory_order_acquire, std::memory_order_relaxed))
+					return;
+			}
+			else if (state == Contended)
+			{
+				break; // Others are already parked, don't compete with them for the line
+			}
+			for (int i = 0; i < backoff; ++i)
+				cpuPause();
+			if (backoff < 64)
+				backoff <<= 1;
+		}
+
+#ifdef THREADUTIL_FUTEX
+		// Mark the lock contended, so the owner wakes us on unlock
+		while (m_State.exchange(Contended, std::memory_order_acquire) != Unlocked)
+			futexWait(&m_State, Contended);
+#else
+		for (;;)
+		{
+			int state = m_State.load(std::memory_order_relaxed);
+			if (state == Unlocked && m_State.compare_exchange_weak(state, Locked, std::memory_order_acquire, std::memory_order_relaxed))
+				return;
+			std::this_thread::yield();
+		}
+#endif
+	}
+
+	std::atomic<int> m_State;
 
 	AtomicLock &operator=(const AtomicLock&) = delete;
 	AtomicLock(const AtomicLock&) = delete;
@@ -0,0 +1,391 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_BLOCK_POOL_H
+#define THREADUTIL_BLOCK_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "atomic_lock.h"
+
+struct BlockPoolStats
+{
+	size_t Allocated; // Blocks handed out to threads, in use or held in a thread cache
+	size_t Capacity; // Blocks carved from chunks so far, in use or free
+	size_t Chunks; // Chunks allocated from the heap
+	size_t Oversized; // Allocations too large for the pool, passed through to the heap
+};
+
+//! Pool of small fixed size blocks in power of two size classes, blocks are recycled instead of going back to the heap
+//! Each thread keeps a small cache of free blocks per pool, so allocating and freeing usually needs no lock or atomic operation
+//! Blocks move between threads in batches through the shared free lists, for example from producers to the consumer and back
+//! Memory is only released when the pool is destroyed, so all blocks must be returned before that
+class BlockPool
+{
+public:
+	enum
+	{
+		MinBlockSize = 32,
+		Classes = 5, // 32 to 512 bytes
+		MaxBlockSize = MinBlockSize << (Classes - 1),
+		ChunkSize = 64 * 1024,
+		ChunkHeader = 64, // Keeps blocks aligned
+		BatchSize = 32, // Blocks moved between a thread cache and the shared lists at once
+	};
+
+	inline BlockPool() : m_Id(nextId()), m_Oversized(0)
+	{
+		for (int c = 0; c < Classes; ++c)
+		{
+			m_Classes[c].Batches = NULL;
+			m_Classes[c].Free = 0;
+			m_Classes[c].Chunks = NULL;
+			m_Classes[c].Cursor = NULL;
+			m_Classes[c].End = NULL;
+			m_Classes[c].Capacity = 0;
+			m_Classes[c].ChunkCount = 0;
+		}
+		Registry &registry = Registry::instance();
+		std::unique_lock<std::mutex> lock(registry.Lock);
+		if (registry.FreeSlots.empty())
+		{
+			m_Slot = registry.Pools.size();
+			registry.Pools.push_back(this);
+		}
+		else
+		{
+			m_Slot = registry.FreeSlots.back();
+			registry.FreeSlots.pop_back();
+			registry.Pools[m_Slot] = this;
+		}
+	}
+
+	~BlockPool()
+	{
+		; {
+			// Caches of other threads still referring to this pool are dropped when the slot is reused, or when the thread exits
+			Registry &registry = Registry::instance();
+			std::unique_lock<std::mutex> lock(registry.Lock);
+			registry.Pools[m_Slot] = NULL;
+			registry.FreeSlots.push_back(m_Slot);
+		}
+		ThreadCache &cache = threadCache();
+		if (m_Slot < cache.Size && cache.Entries[m_Slot].Id == m_Id)
+			cache.Entries[m_Slot].Id = 0;
+		for (int c = 0; c < Classes; ++c)
+		{
+			Chunk *chunk = m_Classes[c].Chunks;
+			while (chunk)
+			{
+				Chunk *next = chunk->Next;
+				::operator delete(chunk);
+				chunk = next;
+			}
+		}
+	}
+
+	void *allocate(size_t size) // thread-safe
+	{
+		int c = sizeClass(size);
+		if (c < 0)
+		{
+			m_Oversized.fetch_add(1, std::memory_order_relaxed);
+			return ::operator new(size);
+		}
+		ClassCache &cache = entry().Caches[c];
+		if (!cache.Free)
+			refill(c, cache);
+		Block *block = cache.Free;
+		cache.Free = block->Next;
+		--cache.Count;
+		return block;
+	}
+
+	//! Size must match the size passed to allocate
+	void deallocate(void *p, size_t size) // thread-safe
+	{
+		int c = sizeClass(size);
+		if (c < 0)
+		{
+			::operator delete(p);
+			m_Oversized.fetch_sub(1, std::memory_order_relaxed);
+			return;
+		}
+		ClassCache &cache = entry().Caches[c];
+		Block *block = static_cast<Block *>(p);
+		block->Next = cache.Free;
+		cache.Free = block;
+		if (++cache.Count >= 2 * BatchSize)
+			flush(c, cache, BatchSize);
+	}
+
+	BlockPoolStats stats() // thread-safe
+	{
+		BlockPoolStats stats;
+		stats.Allocated = 0;
+		stats.Capacity = 0;
+		stats.Chunks = 0;
+		for (int c = 0; c < Classes; ++c)
+		{
+			std::unique_lock<AtomicLock> lock(m_Classes[c].Lock);
+			stats.Allocated += m_Classes[c].Capacity - m_Classes[c].Free;
+			stats.Capacity += m_Classes[c].Capacity;
+			stats.Chunks += m_Classes[c].ChunkCount;
+		}
+		stats.Oversized = m_Oversized.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	static inline int sizeClass(size_t size)
+	{
+		if (size > MaxBlockSize)
+			return -1;
+		int c = 0;
+		while (((size_t)MinBlockSize << c) < size)
+			++c;
+		return c;
+	}
+
+private:
+	struct Block
+	{
+		Block *Next;
+		Block *NextBatch; // Only set on the first block of a batch in the shared list
+		size_t Count; // Only set on the first block of a batch in the shared list
+	};
+
+	struct Chunk
+	{
+		Chunk *Next;
+	};
+
+	struct Class
+	{
+		AtomicLock Lock;
+		Block *Batches;
+		size_t Free; // Blocks in Batches
+		Chunk *Chunks;
+		char *Cursor;
+		char *End;
+		size_t Capacity;
+		size_t ChunkCount;
+	};
+
+	struct ClassCache
+	{
+		Block *Free;
+		size_t Count;
+	};
+
+	struct CacheEntry
+	{
+		uint64_t Id; // Zero when unused, pool ids are never reused
+		BlockPool *Pool;
+		ClassCache Caches[Classes];
+	};
+
+	//! Per thread caches indexed by pool slot, zero initialized so that accessing them needs no initialization check
+	//! Grows with the number of pools alive at the same time, an entry left behind by a destroyed pool is reset when its slot is reused
+	struct ThreadCache
+	{
+		CacheEntry *Entries;
+		size_t Size;
+		bool Registered;
+	};
+
+	//! Returns the caches of a thread to their pool when the thread exits, if the pool still exists
+	struct ThreadCacheRelease
+	{
+	public:
+		~ThreadCacheRelease()
+		{
+			ThreadCache &cache = threadCache();
+			Registry &registry = Registry::instance();
+			std::unique_lock<std::mutex> lock(registry.Lock);
+			for (size_t i = 0; i < cache.Size; ++i)
+			{
+				CacheEntry &entry = cache.Entries[i];
+				BlockPool *pool = i < registry.Pools.size() ? registry.Pools[i] : NULL;
+				if (entry.Id && pool == entry.Pool && pool->m_Id == entry.Id)
+					for (int c = 0; c < Classes; ++c)
+						if (entry.Caches[c].Count)
+							pool->flush(c, entry.Caches[c], entry.Caches[c].Count);
+			}
+			delete[] cache.Entries;
+			cache.Entries = NULL;
+			cache.Size = 0;
+		}
+	};
+
+	//! Pools which are alive by slot, a thread cache only returns blocks to a pool found here
+	struct Registry
+	{
+	public:
+		static Registry &instance()
+		{
+			static Registry *s_Registry = new Registry(); // Never destroyed, thread caches may be released during static destruction
+			return *s_Registry;
+		}
+
+		std::mutex Lock;
+		std::vector<BlockPool *> Pools; // NULL for free slots
+		std::vector<size_t> FreeSlots;
+	};
+
+	static inline uint64_t nextId()
+	{
+		static std::atomic<uint64_t> s_Id(0);
+		return s_Id.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+
+	static inline ThreadCache &threadCache()
+	{
+		static thread_local ThreadCache s_Cache;
+		return s_Cache;
+	}
+
+	//! Cache entry of the calling thread for this pool
+	inline CacheEntry &entry()
+	{
+		ThreadCache &cache = threadCache();
+		if (m_Slot < cache.Size)
+		{
+			CacheEntry &res = cache.Entries[m_Slot];
+			if (res.Id == m_Id)
+				return res;
+		}
+		return newEntry();
+	}
+
+	//! First use of this pool by the calling thread, or first use since another pool held the slot
+	CacheEntry &newEntry()
+	{
+		ThreadCache &cache = threadCache();
+		if (!cache.Registered)
+		{
+			static thread_local ThreadCacheRelease s_Release;
+			(void)s_Release;
+			cache.Registered = true;
+		}
+		if (m_Slot >= cache.Size)
+		{
+			size_t size = cache.Size ? cache.Size * 2 : 8;
+			while (size <= m_Slot)
+				size *= 2;
+			CacheEntry *entries = new CacheEntry[size]();
+			for (size_t i = 0; i < cache.Size; ++i)
+				entries[i] = cache.Entries[i];
+			delete[] cache.Entries;
+			cache.Entries = entries;
+			cache.Size = size;
+		}
+		// Any blocks still here belonged to a destroyed pool, and were freed with its chunks
+		CacheEntry &res = cache.Entries[m_Slot];
+		res.Id = m_Id;
+		res.Pool = this;
+		for (int c = 0; c < Classes; ++c)
+		{
+			res.Caches[c].Free = NULL;
+			res.Caches[c].Count = 0;
+		}
+		return res;
+	}
+
+	//! Take a batch from the shared list, or carve a new one
+	void refill(int c, ClassCache &cache)
+	{
+		Class &cls = m_Classes[c];
+		std::unique_lock<AtomicLock> lock(cls.Lock);
+		if (cls.Batches)
+		{
+			Block *batch = cls.Batches;
+			cls.Batches = batch->NextBatch;
+			cls.Free -= batch->Count;
+			cache.Free = batch;
+			cache.Count = batch->Count;
+			return;
+		}
+		size_t blockSize = (size_t)MinBlockSize << c;
+		for (int i = 0; i < BatchSize; ++i)
+		{
+			if (cls.Cursor == cls.End)
+			{
+				if (i)
+					break;
+				Chunk *chunk = static_cast<Chunk *>(::operator new(ChunkSize));
+				chunk->Next = cls.Chunks;
+				cls.Chunks = chunk;
+				cls.Cursor = reinterpret_cast<char *>(chunk) + ChunkHeader;
+				cls.End = cls.Cursor + ((ChunkSize - ChunkHeader) / blockSize) * blockSize;
+				++cls.ChunkCount;
+			}
+			Block *block = reinterpret_cast<Block *>(cls.Cursor);
+			cls.Cursor += blockSize;
+			++cls.Capacity;
+			block->Next = cache.Free;
+			cache.Free = block;
+			++cache.Count;
+		}
+	}
+
+	//! Give count blocks from the cache back to the shared list as one batch
+	void flush(int c, ClassCache &cache, size_t count)
+	{
+		Block *batch = cache.Free;
+		Block *last = batch;
+		for (size_t i = 1; i < count; ++i)
+			last = last->Next;
+		cache.Free = last->Next;
+		cache.Count -= count;
+		last->Next = NULL;
+		batch->Count = count;
+		Class &cls = m_Classes[c];
+		std::unique_lock<AtomicLock> lock(cls.Lock);
+		batch->NextBatch = cls.Batches;
+		cls.Batches = batch;
+		cls.Free += count;
+	}
+
+	uint64_t m_Id;
+	size_t m_Slot; // Index in the registry and in the thread caches
+	Class m_Classes[Classes];
+	std::atomic<size_t> m_Oversized;
+
+	BlockPool &operator=(const BlockPool&) = delete;
+	BlockPool(const BlockPool&) = delete;
+
+};
+
+#endif /* THREADUTIL_BLOCK_POOL_H */
+
+/* end of file */
@@ -0,0 +1,266 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_CLH_LOCK_H
+#define THREADUTIL_CLH_LOCK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cpu_pause.h"
+#include "futex.h"
+
+#ifndef CLH_LOCK_SPIN_LIMIT
+#define CLH_LOCK_SPIN_LIMIT 128
+#endif
+
+#ifndef CLH_LOCK_YIELD_LIMIT
+#define CLH_LOCK_YIELD_LIMIT 8
+#endif
+
+#ifndef CLH_LOCK_CHUNK_SIZE
+#define CLH_LOCK_CHUNK_SIZE 256
+#endif
+
+#ifndef CLH_LOCK_MAX_CHUNKS
+#define CLH_LOCK_MAX_CHUNKS 4096
+#endif
+
+//! Fair FIFO queue lock (Craig, Landin and Hagersten). Waiters are granted the lock in arrival order,
+//! and each spins on its predecessor's node, so a release only touches the cache line of the next waiter
+//! Waiters spin briefly, then yield, then park on a futex (or keep yielding where there is no futex)
+//! The spin budget is kept short, since a waiter can only proceed once every thread ahead of it has had its turn
+//! The tail word packs the index of the last queued node with the number of threads holding or queued for the lock,
+//! so try_lock can take an idle lock with a single compare and swap, without reading any node it does not own
+class ClhLock
+{
+public:
+	inline ClhLock()
+	{
+		m_Tail.store(pack(NodeTable::instance().allocate(), 0), std::memory_order_relaxed);
+		m_Owner = NULL;
+	}
+
+	~ClhLock()
+	{
+		// Lock must not be held, wait for the last unlock to be done with this lock
+		uint64_t tail;
+		while (count(tail = m_Tail.load(std::memory_order_acquire)))
+			std::this_thread::yield();
+		NodeTable::instance().free(index(tail)); // The tail node belongs to the lock
+	}
+
+	inline void lock()
+	{
+		Spare &node = spare();
+		node.Node->State.store(Locked, std::memory_order_relaxed);
+		uint64_t tail = m_Tail.load(std::memory_order_relaxed);
+		while (!m_Tail.compare_exchange_weak(tail, pack(node.Index, count(tail) + 1), std::memory_order_acq_rel, std::memory_order_relaxed));
+		Node &pred = NodeTable::instance().node(index(tail));
+		wait(pred);
+		acquired(node, index(tail), &pred);
+	}
+
+	inline bool try_lock()
+	{
+		uint64_t tail = m_Tail.load(std::memory_order_relaxed);
+		if (count(tail))
+			return false; // Held or queued
+		Spare &node = spare();
+		node.Node->State.store(Locked, std::memory_order_relaxed);
+		if (!m_Tail.compare_exchange_strong(tail, pack(node.Index, 1), std::memory_order_acq_rel, std::memory_order_relaxed))
+			return false;
+		// The lock was idle, every earlier holder released its node before leaving the count
+		acquired(node, index(tail), &NodeTable::instance().node(index(tail)));
+		return true;
+	}
+
+	inline bool tryLock()
+	{
+		return try_lock();
+	}
+
+	inline void unlock()
+	{
+		Node *node = m_Owner;
+#ifdef THREADUTIL_FUTEX
+		if (node->State.exchange(Unlocked, std::memory_order_release) == Parked)
+			futexWake(&node->State, 1);
+#else
+		node->State.store(Unlocked, std::memory_order_release);
+#endif
+		m_Tail.fetch_sub(1, std::memory_order_release); // Last access to this lock
+	}
+
+private:
+	enum
+	{
+		Unlocked = 0,
+		Locked = 1,
+		Parked = 2, // Locked, and the successor is parked on it
+	};
+
+	struct Node
+	{
+	public:
+		Node() : State(Unlocked) { }
+		std::atomic<int> State;
+		char Padding[64 - sizeof(std::atomic<int>)];
+	};
+
+	//! Process wide table of queue nodes, addressed by index. Nodes are recycled but never freed, so a node can always safely be read
+	class NodeTable
+	{
+	public:
+		static inline NodeTable &instance()
+		{
+			static NodeTable *s_Table = new NodeTable(); // Never destroyed, spare nodes are returned during static destruction
+			return *s_Table;
+		}
+
+		inline Node &node(uint32_t index) const
+		{
+			return m_Chunks[index / CLH_LOCK_CHUNK_SIZE].load(std::memory_order_acquire)[index % CLH_LOCK_CHUNK_SIZE];
+		}
+
+		//! Only called when a lock is created and when a thread first uses a lock, so a mutex is fine
+		uint32_t allocate() // thread-safe
+		{
+			std::unique_lock<std::mutex> lock(m_Lock);
+			if (!m_Free.empty())
+			{
+				uint32_t index = m_Free.back();
+				m_Free.pop_back();
+				return index;
+			}
+			uint32_t index = m_Size++;
+			uint32_t chunk = index / CLH_LOCK_CHUNK_SIZE;
+			if (chunk >= CLH_LOCK_MAX_CHUNKS)
+			{
+				fprintf(stderr, "ClhLock: out of queue nodes\n");
+				abort();
+			}
+			if (!(index % CLH_LOCK_CHUNK_SIZE))
+				m_Chunks[chunk].store(new Node[CLH_LOCK_CHUNK_SIZE], std::memory_order_release);
+			return index;
+		}
+
+		void free(uint32_t index) // thread-safe
+		{
+			std::unique_lock<std::mutex> lock(m_Lock);
+			m_Free.push_back(index);
+		}
+
+	private:
+		inline NodeTable() : m_Size(0)
+		{
+			for (int i = 0; i < CLH_LOCK_MAX_CHUNKS; ++i)
+				m_Chunks[i].store(NULL, std::memory_order_relaxed);
+		}
+
+		std::mutex m_Lock;
+		std::vector<uint32_t> m_Free;
+		uint32_t m_Size;
+		std::atomic<Node *> m_Chunks[CLH_LOCK_MAX_CHUNKS];
+
+	};
+
+	//! Each thread owns one spare node, which it swaps for its predecessor's node on every acquisition
+	struct Spare
+	{
+	public:
+		Spare() : Index(NodeTable::instance().allocate()), Node(&NodeTable::instance().node(Index)) { }
+		~Spare() { NodeTable::instance().free(Index); }
+		uint32_t Index;
+		ClhLock::Node *Node;
+	};
+
+	static inline Spare &spare()
+	{
+		static thread_local Spare s_Spare;
+		return s_Spare;
+	}
+
+	static inline uint64_t pack(uint32_t index, uint32_t count) { return ((uint64_t)index << 32) | count; }
+	static inline uint32_t index(uint64_t tail) { return (uint32_t)(tail >> 32); }
+	static inline uint32_t count(uint64_t tail) { return (uint32_t)tail; }
+
+	inline void acquired(Spare &node, uint32_t predIndex, Node *pred)
+	{
+		// Nobody references the predecessor node anymore, it becomes this thread's spare
+		m_Owner = node.Node;
+		node.Index = predIndex;
+		node.Node = pred;
+	}
+
+	static void wait(Node &pred)
+	{
+		for (int spin = 0; spin < CLH_LOCK_SPIN_LIMIT; ++spin)
+		{
+			if (pred.State.load(std::memory_order_acquire) == Unlocked)
+				return;
+			cpuPause();
+		}
+		for (int spin = 0; spin < CLH_LOCK_YIELD_LIMIT; ++spin)
+		{
+			if (pred.State.load(std::memory_order_acquire) == Unlocked)
+				return;
+			std::this_thread::yield();
+		}
+#ifdef THREADUTIL_FUTEX
+		int state = Locked;
+		if (pred.State.compare_exchange_strong(state, Parked, std::memory_order_acquire) || state == Parked)
+		{
+			do
+			{
+				futexWait(&pred.State, Parked);
+			} while (pred.State.load(std::memory_order_acquire) != Unlocked);
+		}
+#else
+		while (pred.State.load(std::memory_order_acquire) != Unlocked)
+			std::this_thread::yield();
+#endif
+	}
+
+	std::atomic<uint64_t> m_Tail; // Index of the last queued node in the upper half, holder and waiters in the lower half
+	char m_Padding[64 - sizeof(std::atomic<uint64_t>)];
+	Node *m_Owner; // Only accessed by the thread holding the lock
+
+	ClhLock &operator=(const ClhLock&) = delete;
+	ClhLock(const ClhLock&) = delete;
+
+};
+
+#endif /* THREADUTIL_CLH_LOCK_H */
+
+/* end of file */
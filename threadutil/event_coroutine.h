@@ -0,0 +1,122 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_EVENT_COROUTINE_H
+#define THREADUTIL_EVENT_COROUTINE_H
+
+#include "event_loop.h"
+#include "future.h"
+
+#ifdef __cpp_impl_coroutine
+
+#include <coroutine>
+#include <exception>
+
+//! Fire and forget coroutine running on event loops, starts right away and destroys its frame when it finishes
+//! Frames are allocated from the pool of the event loop passed as the first argument, or else the loop running on the calling thread
+//! A coroutine which is never resumed, for example waiting on a lock for a dead receiver, leaks its frame
+struct EventCoroutine
+{
+public:
+	struct promise_type
+	{
+	public:
+		inline EventCoroutine get_return_object() { return EventCoroutine(); }
+		inline std::suspend_never initial_suspend() { return std::suspend_never(); }
+		inline std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		inline void return_void() { }
+		inline void unhandled_exception() { std::terminate(); }
+
+		template<class ... TArgs>
+		static void *operator new(size_t size, EventLoop &loop, TArgs &&...) { return allocate(&loop, size); }
+
+		template<class TClass, class ... TArgs>
+		static void *operator new(size_t size, TClass &, EventLoop &loop, TArgs &&...) { return allocate(&loop, size); } // Member coroutines
+
+		static void *operator new(size_t size) { return allocate(EventLoop::current(), size); }
+
+		static void operator delete(void *p, size_t size)
+		{
+			Header *header = static_cast<Header *>(p) - 1;
+			if (header->Loop)
+				header->Loop->deallocate(header, size + sizeof(Header));
+			else
+				::operator delete(header);
+		}
+
+	private:
+		//! Remembers which pool the frame came from, the frame may be destroyed on another loop's thread
+		struct alignas(std::max_align_t) Header
+		{
+			EventLoop *Loop;
+		};
+
+		static void *allocate(EventLoop *loop, size_t size)
+		{
+			Header *header = static_cast<Header *>(loop ? loop->allocate(size + sizeof(Header)) : ::operator new(size + sizeof(Header)));
+			header->Loop = loop;
+			return header + 1;
+		}
+	};
+
+};
+
+//! co_await future suspends until the value is set, and continues on the loop running the coroutine (or else the loop of the promise)
+template<class T>
+struct FutureAwaiter
+{
+public:
+	inline FutureAwaiter(Future<T> &&future) : m_Future(std::move(future)) { }
+
+	inline bool await_ready() const { return m_Future.ready(); }
+
+	inline void await_suspend(std::coroutine_handle<> handle)
+	{
+		EventLoop *loop = EventLoop::current();
+		FutureState<T> *state = m_Future.m_State;
+		state->continueWith(loop ? *loop : state->eventLoop(), EventTask(EventLoop::ResumeTask(handle)));
+	}
+
+	inline typename FutureValue<T>::Type await_resume() { return std::move(m_Future.m_State->value()); }
+
+private:
+	Future<T> m_Future;
+
+};
+
+template<class T>
+inline FutureAwaiter<T> operator co_await(Future<T> &&future)
+{
+	return FutureAwaiter<T>(std::move(future));
+}
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* THREADUTIL_EVENT_COROUTINE_H */
+
+/* end of file */
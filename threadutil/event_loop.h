@@ -31,59 +31,332 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef WIN32
 #define EVENT_LOOP_CONCURRENT_QUEUE
-#define EVENT_LOOP_WIN32_EVENT
 #define EVENT_LOOP_ATOMIC_LOCK
 #else
 // #define EVENT_LOOP_CONCURRENT_QUEUE
-// #define EVENT_LOOP_WIN32_EVENT
+#define EVENT_LOOP_MPSC_QUEUE
 #define EVENT_LOOP_ATOMIC_LOCK
+// #define EVENT_LOOP_CLH_LOCK
 #endif
 
+#ifndef EVENT_LOOP_BATCH_SIZE
+#define EVENT_LOOP_BATCH_SIZE 1024
+#endif
+
+#ifndef EVENT_LOOP_STARVATION_LIMIT
+#define EVENT_LOOP_STARVATION_LIMIT 64
+#endif
+
+// Keep counters and latency histograms, read through EventLoop::stats()
+// #define EVENT_LOOP_METRICS
+
+// Record a timeline of posted and executed functions, written out through EventLoop::dumpTrace()
+// #define EVENT_LOOP_TRACE
+
+#include <assert.h>
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
 #include <functional>
+#include <memory>
+
+#include <deque>
 
-#include <queue>
-#include <set>
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+
+#include "event_task.h"
+#include "timer_wheel.h"
+#include "thread_pool.h"
+#include "block_pool.h"
 
 #ifdef EVENT_LOOP_CONCURRENT_QUEUE
 #include <concurrent_queue.h>
-#include <concurrent_priority_queue.h>
-#else
-#	ifdef EVENT_LOOP_ATOMIC_LOCK
+#elif defined(EVENT_LOOP_MPSC_QUEUE)
+#include "mpsc_queue.h"
+#endif
+
+#ifdef EVENT_LOOP_CLH_LOCK
+#include "clh_lock.h"
+typedef ClhLock EventLoopLock;
+#elif defined(EVENT_LOOP_ATOMIC_LOCK)
 #include "atomic_lock.h"
 typedef AtomicLock EventLoopLock;
-#	else
+#else
 typedef std::mutex EventLoopLock;
-#	endif
 #endif
 
-#ifdef EVENT_LOOP_WIN32_EVENT
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
+#include "atomic_event.h"
+
+#ifdef EVENT_LOOP_METRICS
+#include "event_metrics.h"
+#endif
+
+#ifdef EVENT_LOOP_TRACE
+#include "event_trace.h"
 #endif
 
 typedef std::function<void()> EventFunction;
+typedef TimerWheel::Handle EventTimer;
+
+struct EventTimerStats
+{
+	uint64_t Wakeups; // Number of times the loop thread was woken up after parking
+	uint64_t Fired; // Number of timeout and interval calls
+	uint64_t Coalesced; // Number of timer calls that were delayed within their slack to share a wakeup
+	uint64_t WakeupsSaved; // Number of wakeups avoided by coalescing
+	size_t Pending; // Number of timers currently scheduled
+};
+
+#if defined(EVENT_LOOP_METRICS) || defined(EVENT_LOOP_TRACE)
+#define EVENT_LOOP_QUEUE_ITEM
+#endif
+
+#ifdef EVENT_LOOP_QUEUE_ITEM
+//! Queued immediate function with the time it was posted and its trace id
+struct EventQueueItem
+{
+public:
+	inline EventQueueItem()
+	{
+#ifdef EVENT_LOOP_TRACE
+		Trace = 0;
+#endif
+	}
+
+	inline EventQueueItem(EventTask &&task) : Task(std::move(task))
+	{
+#ifdef EVENT_LOOP_METRICS
+		Posted = std::chrono::steady_clock::now();
+#endif
+#ifdef EVENT_LOOP_TRACE
+		Trace = 0;
+#endif
+	}
+
+	inline EventQueueItem(EventQueueItem &&other) : Task(std::move(other.Task))
+	{
+		copyFrom(other);
+	}
+
+	inline EventQueueItem &operator=(EventQueueItem &&other)
+	{
+		Task = std::move(other.Task);
+		copyFrom(other);
+		return *this;
+	}
+
+	EventTask Task;
+#ifdef EVENT_LOOP_METRICS
+	std::chrono::steady_clock::time_point Posted;
+#endif
+#ifdef EVENT_LOOP_TRACE
+	uint64_t Trace;
+#endif
+
+private:
+	inline void copyFrom(const EventQueueItem &other)
+	{
+#ifdef EVENT_LOOP_METRICS
+		Posted = other.Posted;
+#endif
+#ifdef EVENT_LOOP_TRACE
+		Trace = other.Trace;
+#endif
+	}
+
+};
+#else
+typedef EventTask EventQueueItem;
+#endif
+
+//! Queue of immediate functions, multiple producers and a single consumer
+class EventQueue
+{
+public:
+	inline EventQueue()
+#if !defined(EVENT_LOOP_CONCURRENT_QUEUE) && !defined(EVENT_LOOP_MPSC_QUEUE)
+		: m_Queued(false)
+#endif
+	{
+
+	}
+
+	//! Pool for the queue nodes, only call before the first push
+	inline void setBlockPool(BlockPool *pool)
+	{
+#ifdef EVENT_LOOP_MPSC_QUEUE
+		m_Mpsc.setBlockPool(pool);
+#endif
+	}
+
+	inline void push(EventQueueItem &&task) // thread-safe
+	{
+#ifdef EVENT_LOOP_CONCURRENT_QUEUE
+		m_Concurrent.push(std::move(task));
+#elif defined(EVENT_LOOP_MPSC_QUEUE)
+		m_Mpsc.push(std::move(task));
+#else
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		m_Queue.push_back(std::move(task));
+		m_Queued.store(true, std::memory_order_relaxed);
+#endif
+	}
+
+	//! Only call from the consumer thread
+	inline bool tryPop(EventTask &task)
+	{
+#ifdef EVENT_LOOP_QUEUE_ITEM
+		EventQueueItem item;
+		if (!tryPopItem(item))
+			return false;
+		task = std::move(item.Task);
+#ifdef EVENT_LOOP_METRICS
+		m_LastPosted = item.Posted;
+#endif
+#ifdef EVENT_LOOP_TRACE
+		m_LastTrace = item.Trace;
+#endif
+		return true;
+#else
+		return tryPopItem(task);
+#endif
+	}
+
+#ifdef EVENT_LOOP_METRICS
+	//! Time at which the last popped function was posted, only call from the consumer thread
+	inline const std::chrono::steady_clock::time_point &lastPosted() const { return m_LastPosted; }
+#endif
+
+#ifdef EVENT_LOOP_TRACE
+	//! Trace id of the last popped function, only call from the consumer thread
+	inline uint64_t lastTrace() const { return m_LastTrace; }
+#endif
+
+	//! Only call from the consumer thread
+	inline bool empty()
+	{
+#ifdef EVENT_LOOP_CONCURRENT_QUEUE
+		return m_Concurrent.empty();
+#elif defined(EVENT_LOOP_MPSC_QUEUE)
+		return m_Mpsc.empty();
+#else
+		return m_Batch.empty() && !m_Queued.load(std::memory_order_relaxed);
+#endif
+	}
+
+	//! Only call from the consumer thread, or while the consumer is stopped. Returns the number of functions dropped
+	inline size_t clear()
+	{
+#ifdef EVENT_LOOP_CONCURRENT_QUEUE
+		size_t res = 0;
+		EventQueueItem item;
+		while (m_Concurrent.try_pop(item))
+			++res;
+		return res;
+#elif defined(EVENT_LOOP_MPSC_QUEUE)
+		return m_Mpsc.clear();
+#else
+		size_t res = m_Batch.size();
+		m_Batch.clear();
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		res += m_Queue.size();
+		m_Queue.clear();
+		m_Queued.store(false, std::memory_order_relaxed);
+		return res;
+#endif
+	}
+
+private:
+	inline bool tryPopItem(EventQueueItem &task)
+	{
+#ifdef EVENT_LOOP_CONCURRENT_QUEUE
+		return m_Concurrent.try_pop(task);
+#elif defined(EVENT_LOOP_MPSC_QUEUE)
+		return m_Mpsc.tryPop(task);
+#else
+		if (m_Batch.empty())
+		{
+			// Take the whole pending batch under a single lock
+			if (!m_Queued.load(std::memory_order_relaxed))
+				return false;
+			std::unique_lock<EventLoopLock> lock(m_Lock);
+			if (m_Queue.empty())
+				return false;
+			m_Batch.swap(m_Queue);
+			m_Queued.store(false, std::memory_order_relaxed);
+		}
+		task = std::move(m_Batch.front());
+		m_Batch.pop_front();
+		return true;
+#endif
+	}
+
+#ifdef EVENT_LOOP_CONCURRENT_QUEUE
+	concurrency::concurrent_queue<EventQueueItem> m_Concurrent;
+#elif defined(EVENT_LOOP_MPSC_QUEUE)
+	MpscQueue<EventQueueItem> m_Mpsc;
+#else
+	EventLoopLock m_Lock;
+	std::deque<EventQueueItem> m_Queue;
+	std::deque<EventQueueItem> m_Batch; // Consumer only
+	std::atomic_bool m_Queued; // Set when m_Queue is not empty, lets the consumer check without locking
+#endif
+#ifdef EVENT_LOOP_METRICS
+	std::chrono::steady_clock::time_point m_LastPosted; // Consumer only
+#endif
+#ifdef EVENT_LOOP_TRACE
+	uint64_t m_LastTrace; // Consumer only
+#endif
+
+	EventQueue &operator=(const EventQueue&) = delete;
+	EventQueue(const EventQueue&) = delete;
+
+};
+
+enum class EventPriority
+{
+	High, // Control functions, such as health checks or shutdown
+	Normal,
+	Background, // Bulk work
+};
 
 class EventLoop
 {
 public:
-	EventLoop() : m_Running(false), m_Cancel(false)
+	EventLoop() : EventLoop(std::make_shared<ThreadPool>())
 	{
-#ifdef EVENT_LOOP_WIN32_EVENT
-		m_PokeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	}
+
+	//! Runs blocking work from thread() on the given pool, which may be shared with other loops
+	explicit EventLoop(std::shared_ptr<ThreadPool> threadPool) : m_ThreadPool(std::move(threadPool)), m_ThreadCalls(0), m_Running(false), m_StarvationLimit(EVENT_LOOP_STARVATION_LIMIT), m_Cancel(false), m_BatchSize(EVENT_LOOP_BATCH_SIZE), m_TimerSlack(std::chrono::steady_clock::duration::zero()), m_Wakeups(0), m_Posted(0), m_Executed(0), m_Taken(0)
+#ifdef EVENT_LOOP_METRICS
+		, m_Parked(0), m_Timeouts(0)
 #endif
+	{
+		for (int l = 0; l < Lanes; ++l)
+		{
+			m_Immediate[l].setBlockPool(&m_BlockPool);
+			m_Skipped[l] = 0;
+		}
+
 	}
 
 	~EventLoop()
 	{
 		stop();
+		; {
+			// Finish blocking work before dropping its callbacks, the pool may outlive this loop
+			std::unique_lock<std::mutex> lock(m_ThreadLock);
+			while (m_ThreadCalls)
+				m_ThreadDone.wait(lock);
+		}
+		m_ThreadPool.reset();
 		clear();
-#ifdef EVENT_LOOP_WIN32_EVENT
-		CloseHandle(m_PokeEvent);
-#endif
 	}
 
 	void run()
@@ -108,17 +381,27 @@ public:
 			m_Thread.join();
 	}
 
-	void clear() // semi-thread-safe
+	//! Drop all queued functions and timers. Only call from a function running on this loop, or while it is stopped
+	void clear()
 	{
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-		m_ImmediateConcurrent.clear();
-		m_TimeoutConcurrent.clear();
-#else
-		std::unique_lock<EventLoopLock> lock(m_QueueLock);
+		assert(!m_Running || currentRef() == this); // The queues are consumer only
+		for (int l = 0; l < Lanes; ++l)
+			m_Taken += m_Immediate[l].clear();
+		m_Executed.store(m_Taken, std::memory_order_relaxed);
 		std::unique_lock<EventLoopLock> tlock(m_QueueTimeoutLock);
-		m_Immediate = std::move(std::queue<EventFunction>());
-		m_Timeout = std::move(std::priority_queue<timeout_func>());
-#endif
+		m_Timeout.clear();
+		timeoutsChanged();
+	}
+
+	//! Cancel a pending timeout or interval, its function is destroyed right away. Returns false if it already ran or was cleared
+	bool clear(const EventTimer &timer) // thread-safe
+	{
+		EventTask f;
+		std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
+		bool res = m_Timeout.erase(timer, f);
+		timeoutsChanged();
+		lock.unlock(); // Destroy the function outside the lock
+		return res;
 	}
 
 	//! Call from inside an interval function to prevent it from being called again
@@ -127,6 +410,63 @@ public:
 		m_Cancel = true;
 	}
 
+	//! Maximum number of immediate functions to run in one pass before checking the timeouts, zero for no limit
+	void setBatchSize(size_t batchSize)
+	{
+		m_BatchSize = batchSize;
+	}
+
+	//! Maximum number of functions from higher priority lanes that may run while a lower priority lane is waiting
+	void setStarvationLimit(unsigned int limit)
+	{
+		m_StarvationLimit = limit;
+	}
+
+	//! Default slack for timers, a timer may fire up to this much later so that nearby timers can share a single wakeup
+	template<class rep, class period> void setTimerSlack(const std::chrono::duration<rep, period> &slack) // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
+		m_TimerSlack = std::chrono::duration_cast<std::chrono::steady_clock::duration>(slack);
+	}
+
+	//! Approximate number of immediate functions waiting to run, the loop publishes its progress every few functions
+	size_t pending() const // thread-safe
+	{
+		uint64_t executed = m_Executed.load(std::memory_order_relaxed);
+		uint64_t posted = m_Posted.load(std::memory_order_relaxed);
+		return posted > executed ? (size_t)(posted - executed) : 0;
+	}
+
+	EventTimerStats timerStats() // thread-safe
+	{
+		EventTimerStats stats;
+		stats.Wakeups = m_Wakeups.load(std::memory_order_relaxed);
+		std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
+		stats.Fired = m_Timeout.fired();
+		stats.Coalesced = m_Timeout.coalesced();
+		stats.WakeupsSaved = m_Timeout.wakeupsSaved();
+		stats.Pending = m_Timeout.size();
+		return stats;
+	}
+
+#ifdef EVENT_LOOP_METRICS
+	//! Snapshot of the loop metrics without taking any lock, the values are read one by one so they may be slightly out of step with each other
+	EventLoopStats stats() const // thread-safe
+	{
+		EventLoopStats stats;
+		stats.Posted = m_Posted.load(std::memory_order_relaxed);
+		stats.Executed = m_Executed.load(std::memory_order_relaxed);
+		stats.Wakeups = m_Wakeups.load(std::memory_order_relaxed);
+		stats.Immediate = stats.Posted > stats.Executed ? (size_t)(stats.Posted - stats.Executed) : 0;
+		stats.Timeouts = m_Timeouts.load(std::memory_order_relaxed);
+		stats.Parked = std::chrono::nanoseconds(m_Parked.load(std::memory_order_relaxed));
+		m_Latency.snapshot(stats.Latency);
+		m_RunTime.snapshot(stats.RunTime);
+		m_Lateness.snapshot(stats.Lateness);
+		return stats;
+	}
+#endif
+
 	//! Block call until the queued functions  finished processing. Set empty to repeat the wait until the queue is empty
 	void join(bool empty = false) // thread-safe
 	{
@@ -134,16 +474,7 @@ public:
 		std::condition_variable syncCond;
 		std::unique_lock<std::mutex> lock(syncLock);
 		EventFunction syncFunc = [this, &syncLock, &syncCond, &syncFunc, empty]() -> void {
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-			if (empty && !m_ImmediateConcurrent.empty())
-#else
-			bool immediateEmpty;
-			; {
-				std::unique_lock<EventLoopLock> lock(m_QueueLock);
-				immediateEmpty = m_Immediate.empty();
-			}
-			if (empty && !immediateEmpty)
-#endif
+			if (empty && !immediateEmpty())
 			{
 				immediate(syncFunc);
 			}
@@ -158,232 +489,416 @@ public:
 	}
 
 public:
-	void immediate(EventFunction f) // thread-safe
+	template<class TFunc> void immediate(TFunc &&f) // thread-safe
 	{
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-		m_ImmediateConcurrent.push(f);
-#else
-		std::unique_lock<EventLoopLock> lock(m_QueueLock);
-		m_Immediate.push(f);
-#endif
-		poke();
+		immediate(std::forward<TFunc>(f), EventPriority::Normal);
 	}
 
-	template<class rep, class period> void timeout(EventFunction f, const std::chrono::duration<rep, period>& delta) // thread-safe
+	template<class TFunc> void immediate(TFunc &&f, EventPriority priority) // thread-safe
 	{
-		timeout_func tf;
-		tf.f = f;
-		tf.time = std::chrono::steady_clock::now() + delta;
-		tf.interval = std::chrono::nanoseconds::zero();
-		; {
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-			m_TimeoutConcurrent.push(std::move(tf));
+		m_Posted.fetch_add(1, std::memory_order_relaxed); // Own cache line, producers do not contend with the queue or the loop thread
+#ifdef EVENT_LOOP_TRACE
+		EventQueueItem item((EventTask(std::forward<TFunc>(f))));
+		item.Trace = m_Trace.post(EventTrace::Immediate);
+		m_Immediate[(int)priority].push(std::move(item));
 #else
-			std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
-			m_Timeout.push(std::move(tf));
+		m_Immediate[(int)priority].push(EventTask(std::forward<TFunc>(f)));
 #endif
-		}
 		poke();
 	}
 
-	template<class rep, class period> void interval(EventFunction f, const std::chrono::duration<rep, period>& interval) // thread-safe
+	template<class TFunc, class rep, class period> EventTimer timeout(TFunc &&f, const std::chrono::duration<rep, period>& delta) // thread-safe
 	{
-		timeout_func tf;
-		tf.f = f;
-		tf.time = std::chrono::steady_clock::now() + interval;
-		tf.interval = interval;
-		; {
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-			m_TimeoutConcurrent.push(std::move(tf));
-#else
-			std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
-			m_Timeout.push(std::move(tf));
-#endif
-		}
-		poke();
+		return timed(std::forward<TFunc>(f), std::chrono::steady_clock::now() + delta);
 	}
 
+	template<class TFunc, class rep, class period, class srep, class speriod> EventTimer timeout(TFunc &&f, const std::chrono::duration<rep, period>& delta, const std::chrono::duration<srep, speriod>& slack) // thread-safe
+	{
+		return timed(std::forward<TFunc>(f), std::chrono::steady_clock::now() + delta, slack);
+	}
 
-	void timed(EventFunction f, const std::chrono::steady_clock::time_point &point) // thread-safe
+	template<class TFunc, class rep, class period> EventTimer interval(TFunc &&f, const std::chrono::duration<rep, period>& interval) // thread-safe
 	{
-		timeout_func tf;
-		tf.f = f;
-		tf.time = point;
-		tf.interval = std::chrono::steady_clock::duration::zero();
-		; {
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-			m_TimeoutConcurrent.push(std::move(tf));
-#else
-			std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
-			m_Timeout.push(std::move(tf));
+		return addTimer(EventTask(std::forward<TFunc>(f)), std::chrono::steady_clock::now() + interval, interval, DefaultSlack());
+	}
+
+	template<class TFunc, class rep, class period, class srep, class speriod> EventTimer interval(TFunc &&f, const std::chrono::duration<rep, period>& interval, const std::chrono::duration<srep, speriod>& slack) // thread-safe
+	{
+		return addTimer(EventTask(std::forward<TFunc>(f)), std::chrono::steady_clock::now() + interval, interval, std::chrono::duration_cast<std::chrono::steady_clock::duration>(slack));
+	}
+
+	template<class TFunc> EventTimer timed(TFunc &&f, const std::chrono::steady_clock::time_point &point) // thread-safe
+	{
+		return addTimer(EventTask(std::forward<TFunc>(f)), point, std::chrono::steady_clock::duration::zero(), DefaultSlack());
+	}
+
+	template<class TFunc, class srep, class speriod> EventTimer timed(TFunc &&f, const std::chrono::steady_clock::time_point &point, const std::chrono::duration<srep, speriod>& slack) // thread-safe
+	{
+		return addTimer(EventTask(std::forward<TFunc>(f)), point, std::chrono::steady_clock::duration::zero(), std::chrono::duration_cast<std::chrono::steady_clock::duration>(slack));
+	}
+
+public:
+	//! Run a blocking function on the thread pool, and call back on this loop when it's done
+	template<class TFunc, class TCallback> void thread(TFunc &&f, TCallback &&callback) // thread-safe
+	{
+		static_assert(EventTask::fitsInline<ThreadCall>(), "ThreadCall must be stored inline by the thread pool queue");
+		ThreadCall call(this, EventTask(std::forward<TFunc>(f)), EventTask(std::forward<TCallback>(callback)));
+#ifdef EVENT_LOOP_TRACE
+		call.Work->Trace = m_Trace.post(EventTrace::Thread);
 #endif
-		}
-		poke();
+		m_ThreadPool->push(std::move(call));
 	}
 
+	//! Pool used by thread(), to configure its size or read its stats. It is shared when passed in the constructor
+	ThreadPool &threadPool() { return *m_ThreadPool; }
+
 public:
-	void thread(EventFunction f, EventFunction callback)
+	//! Small block allocation from this loop's pool, for state shared between tasks such as futures. May be called from any thread
+	inline void *allocate(size_t size) { return m_BlockPool.allocate(size); } // thread-safe
+	inline void deallocate(void *p, size_t size) { m_BlockPool.deallocate(p, size); } // thread-safe
+
+	//! Pool behind allocate(), to read its occupancy
+	BlockPool &blockPool() { return m_BlockPool; }
+
+#ifdef EVENT_LOOP_TRACE
+	//! Timeline of this loop, for recording custom spans or combining the traces of several loops
+	EventTrace &trace() { return m_Trace; }
+
+	//! Write the recent timeline of this loop as Chrome trace event JSON, open it in Perfetto or chrome://tracing
+	bool dumpTrace(const char *path) // thread-safe
 	{
-		std::thread t([this, f, callback]() -> void {
-			f();
-			immediate(callback);
-		});
-		t.detach();
+		const EventTrace *trace = &m_Trace;
+		return EventTrace::dump(path, &trace, 1);
 	}
+#endif
+
+	//! Loop running on the calling thread, NULL when not called from inside an event loop
+	static EventLoop *current() { return currentRef(); }
+
+#ifdef __cpp_impl_coroutine
+public:
+	struct ResumeTask
+	{
+	public:
+		inline ResumeTask(std::coroutine_handle<> handle) : Handle(handle) { }
+		inline void operator()() { Handle.resume(); }
+		std::coroutine_handle<> Handle;
+	};
+
+	struct ScheduleAwaiter
+	{
+	public:
+		inline bool await_ready() const { return false; }
+		inline void await_suspend(std::coroutine_handle<> handle) { Loop->immediate(ResumeTask(handle)); }
+		inline void await_resume() const { }
+		EventLoop *Loop;
+	};
+
+	struct SleepAwaiter
+	{
+	public:
+		inline bool await_ready() const { return false; }
+		inline void await_suspend(std::coroutine_handle<> handle) { Loop->timed(ResumeTask(handle), Time); }
+		inline void await_resume() const { }
+		EventLoop *Loop;
+		std::chrono::steady_clock::time_point Time;
+	};
+
+	//! co_await loop.schedule() continues the coroutine on this loop, also used to switch between loops
+	inline ScheduleAwaiter schedule() { ScheduleAwaiter res; res.Loop = this; return res; }
+
+	//! co_await loop.sleep(delta) continues the coroutine on this loop after the delay
+	template<class rep, class period> inline SleepAwaiter sleep(const std::chrono::duration<rep, period> &delta) { SleepAwaiter res; res.Loop = this; res.Time = std::chrono::steady_clock::now() + delta; return res; }
+#endif
 
 private:
 	void loop()
 	{
+		EventLoop *previous = currentRef();
+		currentRef() = this;
+#ifdef EVENT_LOOP_TRACE
+		m_Trace.setLoopThread();
+#endif
 		while (m_Running)
 		{
-#ifndef EVENT_LOOP_WIN32_EVENT
-			m_Poked = false;
+			bool more = false; // Batch limit reached, immediate functions remaining
+			size_t batchSize = m_BatchSize;
+			size_t i = 0;
+#ifdef EVENT_LOOP_METRICS
+			std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now(); // The end of one function is the start of the next, saves a clock read per function
 #endif
-
-			for (;;)
+			for (;; ++i)
 			{
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-				EventFunction f;
-				if (!m_ImmediateConcurrent.try_pop(f))
-					break;
-#else
-				m_QueueLock.lock();
-				if (!m_Immediate.size())
+				if (batchSize && i >= batchSize)
 				{
-					m_QueueLock.unlock();
+					more = true;
 					break;
 				}
-				EventFunction f = m_Immediate.front();
-				m_Immediate.pop();
-				m_QueueLock.unlock();
+				EventTask f;
+				if (!popImmediate(f))
+					break;
+				if (!(++m_Taken % ExecutedInterval))
+					m_Executed.store(m_Taken, std::memory_order_relaxed); // Before running, so that a long function still shows the queue behind it
+#ifdef EVENT_LOOP_TRACE
+				m_Trace.start(EventTrace::Immediate, m_LastTrace);
 #endif
+#ifdef EVENT_LOOP_METRICS
+				m_Latency.record(started - m_LastPosted);
+				f();
+				std::chrono::steady_clock::time_point ended = std::chrono::steady_clock::now();
+				m_RunTime.record(ended - started);
+				started = ended;
+#else
 				f();
+#endif
+#ifdef EVENT_LOOP_TRACE
+				m_Trace.end(EventTrace::Immediate, m_LastTrace);
+#endif
 			}
+			if (i)
+				m_Executed.store(m_Taken, std::memory_order_relaxed);
 
-			bool poked = false;
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 			for (;;)
 			{
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-				timeout_func tf;
-				if (!m_TimeoutConcurrent.try_pop(tf))
-					break;
-				const timeout_func &tfr = tf;
-#else
-				m_QueueTimeoutLock.lock();
-				if (!m_Timeout.size())
-				{
-					m_QueueTimeoutLock.unlock();
-					break;
-				}
-				const timeout_func &tfr = m_Timeout.top();
+				EventTimer timer;
+				EventTask f;
+#ifdef EVENT_LOOP_METRICS
+				std::chrono::steady_clock::time_point due;
 #endif
-				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-#ifdef EVENT_LOOP_WIN32_EVENT
-				DWORD wt = (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(tfr.time - now).count();
-				if (tfr.time > now && wt > 0)
-#else
-				if (tfr.time > now) // wait
+				; {
+					std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
+					if (!m_Timeout.expire(now, timer, f))
+						break;
+#ifdef EVENT_LOOP_METRICS
+					due = m_Timeout.time(timer);
 #endif
-				{
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-					m_TimeoutConcurrent.push(tf);
-#else
-					m_QueueTimeoutLock.unlock();
+				}
+				m_Cancel = false;
+#ifdef EVENT_LOOP_TRACE
+				m_Trace.start(EventTrace::Timer, timer.key());
 #endif
-#ifdef EVENT_LOOP_WIN32_EVENT
-					WaitForSingleObject(m_PokeEvent, wt);
+#ifdef EVENT_LOOP_METRICS
+				std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+				m_Lateness.record(started - due);
+				f(); // call
+				m_RunTime.record(std::chrono::steady_clock::now() - started);
 #else
-					; {
-						std::unique_lock<std::mutex> lock(m_PokeLock);
-						if (!m_Poked)
-							m_PokeCond.wait_until(lock, tfr.time);
-					}
+				f(); // call
 #endif
-					poked = true;
-					break;
+#ifdef EVENT_LOOP_TRACE
+				m_Trace.end(EventTrace::Timer, timer.key());
+#endif
+				; {
+					std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
+					if (m_Cancel)
+						m_Timeout.release(timer);
+					else
+						m_Timeout.repeat(timer, f);
+					timeoutsChanged();
 				}
-#ifndef EVENT_LOOP_CONCURRENT_QUEUE
-				timeout_func tf = tfr;
-				m_Timeout.pop();
-				m_QueueTimeoutLock.unlock();
+			}
+
+			if (!more)
+				park();
+		}
+		currentRef() = previous;
+	}
+
+	static inline EventLoop *&currentRef() // private
+	{
+		static thread_local EventLoop *s_Current = NULL;
+		return s_Current;
+	}
+
+	void park() // private
+	{
+		// Announce parking before checking the queues, so that any producer either sees the parked state or has its function visible here
+		m_PokeEvent.prepare();
+		if (!m_Running || !immediateEmpty())
+		{
+			m_PokeEvent.cancel();
+			return;
+		}
+		bool timeout;
+		std::chrono::steady_clock::time_point time;
+		; {
+			std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
+			timeout = m_Timeout.next(time);
+		}
+#ifdef EVENT_LOOP_METRICS
+		std::chrono::steady_clock::time_point parked = std::chrono::steady_clock::now();
 #endif
-				m_Cancel = false;
-				tf.f(); // call
-				if (!m_Cancel && (tf.interval > std::chrono::nanoseconds::zero())) // repeat
-				{
-					tf.time += tf.interval;
-					; {
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-						m_TimeoutConcurrent.push(std::move(tf));
+		if (timeout)
+			m_PokeEvent.waitUntil(time);
+		else
+			m_PokeEvent.wait();
+#ifdef EVENT_LOOP_METRICS
+		uint64_t slept = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - parked).count();
+		m_Parked.store(m_Parked.load(std::memory_order_relaxed) + slept, std::memory_order_relaxed);
+#endif
+		m_Wakeups.store(m_Wakeups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	struct ThreadWork
+	{
+	public:
+		ThreadWork(EventTask &&f, EventTask &&callback) : Function(std::move(f)), Callback(std::move(callback)) { }
+		EventTask Function;
+		EventTask Callback;
+#ifdef EVENT_LOOP_TRACE
+		uint64_t Trace;
+#endif
+	};
+
+	//! Blocking work posted to the thread pool. The functions are kept in a block of the loop's pool, so that the call itself stays small enough to be stored inline
+	struct ThreadCall
+	{
+	public:
+		ThreadCall(EventLoop *loop, EventTask &&f, EventTask &&callback) : Loop(loop), Work(new (loop->allocate(sizeof(ThreadWork))) ThreadWork(std::move(f), std::move(callback))) { loop->threadCallBegin(); }
+		ThreadCall(ThreadCall &&other) noexcept : Loop(other.Loop), Work(other.Work) { other.Work = NULL; }
+		~ThreadCall() { if (Work) { Work->~ThreadWork(); Loop->deallocate(Work, sizeof(ThreadWork)); Loop->threadCallEnd(); } }
+#ifdef EVENT_LOOP_TRACE
+		void operator()() { Loop->m_Trace.start(EventTrace::Thread, Work->Trace); Work->Function(); Loop->m_Trace.end(EventTrace::Thread, Work->Trace); Loop->immediate(std::move(Work->Callback)); }
 #else
-						std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
-						m_Timeout.push(std::move(tf));
+		void operator()() { Work->Function(); Loop->immediate(std::move(Work->Callback)); }
 #endif
-					}
+		EventLoop *Loop;
+		ThreadWork *Work;
+
+		ThreadCall &operator=(const ThreadCall&) = delete;
+		ThreadCall(const ThreadCall&) = delete;
+	};
+
+	//! Pick from the highest priority lane, unless a lower lane has been passed over too often
+	bool popImmediate(EventTask &f) // private
+	{
+		int lane = -1;
+		for (int l = Lanes - 1; l > 0; --l)
+		{
+			if (m_Skipped[l] >= m_StarvationLimit && m_Immediate[l].tryPop(f))
+			{
+				lane = l;
+				break;
+			}
+		}
+		if (lane < 0)
+		{
+			for (int l = 0; l < Lanes; ++l)
+			{
+				if (m_Immediate[l].tryPop(f))
+				{
+					lane = l;
+					break;
 				}
 			}
+			if (lane < 0)
+				return false;
+		}
+		m_Skipped[lane] = 0;
+		for (int l = lane + 1; l < Lanes; ++l)
+			m_Skipped[l] = m_Immediate[l].empty() ? 0 : m_Skipped[l] + 1;
+#ifdef EVENT_LOOP_METRICS
+		m_LastPosted = m_Immediate[lane].lastPosted();
+#endif
+#ifdef EVENT_LOOP_TRACE
+		m_LastTrace = m_Immediate[lane].lastTrace();
+#endif
+		return true;
+	}
 
-			if (!poked)
-			{
-#ifdef EVENT_LOOP_WIN32_EVENT
-				WaitForSingleObject(m_PokeEvent, INFINITE);
-#else
-				std::unique_lock<std::mutex> lock(m_PokeLock);
-				if (!m_Poked)
-					m_PokeCond.wait(lock);
+	bool immediateEmpty() // private
+	{
+		for (int l = 0; l < Lanes; ++l)
+			if (!m_Immediate[l].empty())
+				return false;
+		return true;
+	}
+
+	static inline std::chrono::steady_clock::duration DefaultSlack() { return std::chrono::steady_clock::duration(-1); }
+
+	EventTimer addTimer(EventTask &&f, const std::chrono::steady_clock::time_point &time, const std::chrono::steady_clock::duration &interval, const std::chrono::steady_clock::duration &slack) // private
+	{
+		EventTimer timer;
+		; {
+			std::unique_lock<EventLoopLock> lock(m_QueueTimeoutLock);
+			timer = m_Timeout.insert(std::move(f), time, interval, slack < std::chrono::steady_clock::duration::zero() ? m_TimerSlack : slack);
+			timeoutsChanged();
+#ifdef EVENT_LOOP_TRACE
+			m_Trace.post(EventTrace::Timer, timer.key()); // Under the lock, so that it is recorded before the timer can start
 #endif
-			}
 		}
+		poke();
+		return timer;
 	}
 
-	void poke() // private
+	//! Publish the timer count for stats(), call with m_QueueTimeoutLock held
+	inline void timeoutsChanged() // private
 	{
-#ifdef EVENT_LOOP_WIN32_EVENT
-		SetEvent(m_PokeEvent);
-#else
-		std::unique_lock<std::mutex> lock(m_PokeLock);
-		m_PokeCond.notify_one();
-		m_Poked = true;
+#ifdef EVENT_LOOP_METRICS
+		m_Timeouts.store(m_Timeout.size(), std::memory_order_relaxed);
 #endif
 	}
 
-private:
-	struct timeout_func
+	//! Count blocking work in flight, so that the destructor can wait for it
+	inline void threadCallBegin() // private
 	{
-		EventFunction f;
-		std::chrono::steady_clock::time_point time;
-		std::chrono::steady_clock::duration interval;
+		std::unique_lock<std::mutex> lock(m_ThreadLock);
+		++m_ThreadCalls;
+	}
 
-		bool operator <(const timeout_func &o) const
-		{
-			return time > o.time;
-		}
+	//! Last access to this loop by a ThreadCall, notifies under the lock since the loop may be destroyed right after
+	inline void threadCallEnd() // private
+	{
+		std::unique_lock<std::mutex> lock(m_ThreadLock);
+		if (!--m_ThreadCalls)
+			m_ThreadDone.notify_all();
+	}
 
-	};
+	//! Wake up the loop thread, only costs a system call when it is parked
+	inline void poke() // private
+	{
+		m_PokeEvent.set();
+	}
 
 private:
-	bool m_Running;
-#ifndef EVENT_LOOP_WIN32_EVENT
-	volatile bool m_Poked;
-#endif
+	BlockPool m_BlockPool; // Declared first, so that it outlives anything holding blocks
+	std::shared_ptr<ThreadPool> m_ThreadPool;
+	std::mutex m_ThreadLock;
+	std::condition_variable m_ThreadDone;
+	size_t m_ThreadCalls; // Calls from thread() which are queued or running
+	std::atomic_bool m_Running;
 	std::thread m_Thread;
-#ifndef EVENT_LOOP_WIN32_EVENT
-	std::mutex m_PokeLock;
-	std::condition_variable m_PokeCond;
-#else
-	HANDLE m_PokeEvent;
-#endif
+	AtomicEvent m_PokeEvent;
 
-#ifdef EVENT_LOOP_CONCURRENT_QUEUE
-	concurrency::concurrent_queue<EventFunction> m_ImmediateConcurrent;
-	concurrency::concurrent_priority_queue<timeout_func> m_TimeoutConcurrent;
-#else
-	EventLoopLock m_QueueLock;
-	std::queue<EventFunction> m_Immediate;
+	enum { Lanes = 3 };
+	EventQueue m_Immediate[Lanes];
+	unsigned int m_Skipped[Lanes]; // Consumer only
+	unsigned int m_StarvationLimit;
 	EventLoopLock m_QueueTimeoutLock;
-	std::priority_queue<timeout_func> m_Timeout;
-#endif
+	TimerWheel m_Timeout;
 	bool m_Cancel;
+	size_t m_BatchSize;
+	std::chrono::steady_clock::duration m_TimerSlack;
+	std::atomic<uint64_t> m_Wakeups;
+	char m_PostedPadding[64];
+	std::atomic<uint64_t> m_Posted; // Producers
+	char m_ExecutedPadding[64 - sizeof(std::atomic<uint64_t>)];
+	enum { ExecutedInterval = 16 }; // Immediate functions between updates of m_Executed
+	std::atomic<uint64_t> m_Executed; // Written by the loop thread, run or dropped by clear()
+	uint64_t m_Taken; // Consumer only, published through m_Executed
+#ifdef EVENT_LOOP_METRICS
+	std::atomic<uint64_t> m_Parked; // Nanoseconds
+	std::atomic<size_t> m_Timeouts;
+	std::chrono::steady_clock::time_point m_LastPosted; // Consumer only
+	EventHistogram m_Latency;
+	EventHistogram m_RunTime;
+	EventHistogram m_Lateness;
+#endif
+#ifdef EVENT_LOOP_TRACE
+	EventTrace m_Trace;
+	uint64_t m_LastTrace; // Consumer only
+#endif
 
 };
 
@@ -0,0 +1,176 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_EVENT_LOOP_GROUP_H
+#define THREADUTIL_EVENT_LOOP_GROUP_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "event_loop.h"
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//! Set of event loops, one thread per loop, to spread work over all cores
+class EventLoopGroup
+{
+public:
+	//! Creates one loop per core when size is zero. When pin is set, the thread of loop i is pinned to core i modulo the number of cores
+	//! All loops share one thread pool for their blocking work
+	EventLoopGroup(size_t size = 0, bool pin = true) : m_ThreadPool(std::make_shared<ThreadPool>()), m_Next(0), m_Pin(pin)
+	{
+		size_t cores = std::thread::hardware_concurrency();
+		if (!cores)
+			cores = 1;
+		if (!size)
+			size = cores;
+		m_Cores = cores;
+		m_Loops.reserve(size);
+		for (size_t i = 0; i < size; ++i)
+			m_Loops.push_back(std::unique_ptr<EventLoop>(new EventLoop(m_ThreadPool)));
+	}
+
+	~EventLoopGroup()
+	{
+		stop();
+	}
+
+	void run()
+	{
+		for (size_t i = 0; i < m_Loops.size(); ++i)
+		{
+			if (m_Pin)
+			{
+				int core = (int)(i % m_Cores);
+				m_Loops[i]->immediate([core]() -> void {
+					pinCurrentThread(core);
+				});
+			}
+			m_Loops[i]->run();
+		}
+	}
+
+	void stop() // thread-safe
+	{
+		for (size_t i = 0; i < m_Loops.size(); ++i)
+			m_Loops[i]->stop();
+	}
+
+	//! Block until the functions queued on every loop finished processing. Set empty to repeat the wait until the queues are empty
+	void join(bool empty = false) // thread-safe
+	{
+		for (size_t i = 0; i < m_Loops.size(); ++i)
+			m_Loops[i]->join(empty);
+	}
+
+	inline size_t size() const { return m_Loops.size(); }
+	inline EventLoop &operator[](size_t i) { return *m_Loops[i]; }
+
+	//! Pool shared by thread() of all loops
+	inline ThreadPool &threadPool() { return *m_ThreadPool; }
+
+	//! Next loop in round-robin order
+	EventLoop &next() // thread-safe
+	{
+		return *m_Loops[m_Next.fetch_add(1, std::memory_order_relaxed) % m_Loops.size()];
+	}
+
+	//! Loop with the fewest pending immediate functions, ties are spread round-robin
+	EventLoop &leastLoaded() // thread-safe
+	{
+		size_t count = m_Loops.size();
+		size_t start = m_Next.fetch_add(1, std::memory_order_relaxed) % count;
+		size_t best = start;
+		size_t bestPending = m_Loops[start]->pending();
+		for (size_t i = 1; i < count && bestPending; ++i)
+		{
+			size_t idx = (start + i) % count;
+			size_t pending = m_Loops[idx]->pending();
+			if (pending < bestPending)
+			{
+				best = idx;
+				bestPending = pending;
+			}
+		}
+		return *m_Loops[best];
+	}
+
+	//! Post a copy of the function to every loop
+	template<class TFunc> void broadcast(const TFunc &f) // thread-safe
+	{
+		for (size_t i = 0; i < m_Loops.size(); ++i)
+			m_Loops[i]->immediate(f);
+	}
+
+#ifdef EVENT_LOOP_TRACE
+	//! Write the recent timeline of all loops into one Chrome trace event JSON file
+	bool dumpTrace(const char *path) // thread-safe
+	{
+		std::vector<const EventTrace *> traces;
+		for (size_t i = 0; i < m_Loops.size(); ++i)
+			traces.push_back(&m_Loops[i]->trace());
+		return EventTrace::dump(path, traces.data(), traces.size());
+	}
+#endif
+
+private:
+	static void pinCurrentThread(int core)
+	{
+#ifdef WIN32
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(core, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+		(void)core;
+#endif
+	}
+
+	std::shared_ptr<ThreadPool> m_ThreadPool;
+	std::vector<std::unique_ptr<EventLoop> > m_Loops;
+	std::atomic<size_t> m_Next;
+	size_t m_Cores;
+	bool m_Pin;
+
+	EventLoopGroup &operator=(const EventLoopGroup&) = delete;
+	EventLoopGroup(const EventLoopGroup&) = delete;
+
+};
+
+#endif /* THREADUTIL_EVENT_LOOP_GROUP_H */
+
+/* end of file */
@@ -0,0 +1,138 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#ifndef THREADUTIL_EVENT_METRICS_H
+#define THREADUTIL_EVENT_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+struct EventHistogramStats
+{
+	enum { Buckets = 40 };
+
+	uint64_t Count;
+	uint64_t Sum; // Nanoseconds
+	uint64_t Counts[Buckets]; // Bucket 0 holds durations below 2ns, bucket i holds durations from 2^i ns up to 2^(i+1) ns
+
+	//! Average duration in nanoseconds
+	inline uint64_t mean() const { return Count ? Sum / Count : 0; }
+
+	//! Upper bound in nanoseconds of the bucket that contains the given quantile, for example 0.99
+	uint64_t percentile(double quantile) const
+	{
+		if (!Count)
+			return 0;
+		uint64_t rank = (uint64_t)(quantile * (double)Count);
+		if (rank >= Count)
+			rank = Count - 1;
+		uint64_t seen = 0;
+		for (int b = 0; b < Buckets; ++b)
+		{
+			seen += Counts[b];
+			if (seen > rank)
+				return (uint64_t)1 << (b + 1);
+		}
+		return (uint64_t)1 << Buckets;
+	}
+};
+
+//! Histogram of durations in power of two buckets of nanoseconds, the last bucket also holds anything longer
+//! Written by a single thread, readers take a snapshot without locking
+class EventHistogram
+{
+public:
+	enum { Buckets = EventHistogramStats::Buckets };
+
+	EventHistogram() : m_Sum(0)
+	{
+		for (int b = 0; b < Buckets; ++b)
+			m_Counts[b].store(0, std::memory_order_relaxed);
+	}
+
+	//! Only call from the writing thread
+	inline void record(const std::chrono::steady_clock::duration &duration)
+	{
+		int64_t ns = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+		uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+		int b = bucketOf(value);
+		m_Counts[b].store(m_Counts[b].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		m_Sum.store(m_Sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	void snapshot(EventHistogramStats &stats) const // thread-safe
+	{
+		stats.Count = 0;
+		stats.Sum = m_Sum.load(std::memory_order_relaxed);
+		for (int b = 0; b < Buckets; ++b)
+		{
+			stats.Counts[b] = m_Counts[b].load(std::memory_order_relaxed);
+			stats.Count += stats.Counts[b];
+		}
+	}
+
+private:
+	static inline int bucketOf(uint64_t value)
+	{
+		if (value < 2)
+			return 0;
+#if defined(__GNUC__) || defined(__clang__)
+		int b = 63 - __builtin_clzll(value);
+#else
+		int b = 0;
+		while (value >>= 1)
+			++b;
+#endif
+		return b < Buckets ? b : Buckets - 1;
+	}
+
+	std::atomic<uint64_t> m_Counts[Buckets];
+	std::atomic<uint64_t> m_Sum;
+
+	EventHistogram &operator=(const EventHistogram&) = delete;
+	EventHistogram(const EventHistogram&) = delete;
+
+};
+
+struct EventLoopStats
+{
+	uint64_t Posted; // Immediate functions posted
+	uint64_t Executed; // Immediate functions that ran, or were dropped by EventLoop::clear()
+	uint64_t Wakeups; // Number of times the loop thread was woken up after parking
+	size_t Immediate; // Immediate functions waiting to run
+	size_t Timeouts; // Timers currently scheduled
+	std::chrono::nanoseconds Parked; // Total time the loop thread spent parked
+	EventHistogramStats Latency; // From posting an immediate function until it starts running
+	EventHistogramStats RunTime; // Run time of immediate and timer functions
+	EventHistogramStats Lateness; // From the scheduled time of a timer until it starts running
+};
+
+#endif /* THREADUTIL_EVENT_METRICS_H */
+
+/* end of file */
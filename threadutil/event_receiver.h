@@ -29,34 +29,167 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef THREADUTIL_EVENT_RECEIVER_H
 #define THREADUTIL_EVENT_RECEIVER_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tuple>
+#include <vector>
+
 #include "event_loop.h"
 
+#ifndef EVENT_RECEIVER_CHUNK_SIZE
+#define EVENT_RECEIVER_CHUNK_SIZE 1024
+#endif
+
+#ifndef EVENT_RECEIVER_MAX_CHUNKS
+#define EVENT_RECEIVER_MAX_CHUNKS 4096
+#endif
+
+//! Process wide table of receiver slots, addressed by index and generation
+//! Slots are allocated in chunks which are never released, so a stale handle can always safely read its slot
+//! Destroying a receiver bumps the slot generation, which invalidates all handles to it, and recycles the slot
+class EventReceiverTable
+{
+public:
+	static const uint32_t Invalid = 0xFFFFFFFF;
+
+	struct Slot
+	{
+	public:
+		std::atomic<uint32_t> Generation;
+		std::atomic<uint32_t> NextFree;
+		std::atomic< ::EventLoop *> EventLoop;
+	};
+
+	static inline EventReceiverTable &instance()
+	{
+		static EventReceiverTable *s_Table = new EventReceiverTable(); // Never destroyed, receivers may outlive static destruction
+		return *s_Table;
+	}
+
+	inline Slot &slot(uint32_t index) const
+	{
+		return m_Chunks[index / EVENT_RECEIVER_CHUNK_SIZE].load(std::memory_order_acquire)[index % EVENT_RECEIVER_CHUNK_SIZE];
+	}
+
+	//! Returns the slot index, the generation of the new receiver is the current generation of the slot
+	uint32_t allocate(EventLoop *loop) // thread-safe
+	{
+		uint32_t index = popFree();
+		if (index == Invalid)
+			index = grow();
+		slot(index).EventLoop.store(loop, std::memory_order_release);
+		return index;
+	}
+
+	void free(uint32_t index) // thread-safe
+	{
+		Slot &s = slot(index);
+		s.Generation.fetch_add(1, std::memory_order_acq_rel); // Invalidates all handles
+		uint64_t head = m_FreeHead.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			s.NextFree.store((uint32_t)head, std::memory_order_relaxed);
+			uint64_t next = ((head >> 32) + 1) << 32 | index;
+			if (m_FreeHead.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed))
+				break;
+		}
+	}
+
+private:
+	inline EventReceiverTable() : m_FreeHead(Invalid), m_Size(0)
+	{
+		for (int i = 0; i < EVENT_RECEIVER_MAX_CHUNKS; ++i)
+			m_Chunks[i].store(NULL, std::memory_order_relaxed);
+	}
+
+	//! Free list head is tagged with a counter in the upper half to avoid ABA
+	inline uint32_t popFree()
+	{
+		uint64_t head = m_FreeHead.load(std::memory_order_acquire);
+		for (;;)
+		{
+			uint32_t index = (uint32_t)head;
+			if (index == Invalid)
+				return Invalid;
+			uint64_t next = ((head >> 32) + 1) << 32 | slot(index).NextFree.load(std::memory_order_relaxed);
+			if (m_FreeHead.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+				return index;
+		}
+	}
+
+	//! Running out of slots is fatal, a receiver without a slot could never be reached. Raise EVENT_RECEIVER_MAX_CHUNKS if needed
+	uint32_t grow()
+	{
+		uint32_t index = m_Size.fetch_add(1, std::memory_order_relaxed);
+		uint32_t chunk = index / EVENT_RECEIVER_CHUNK_SIZE;
+		if (chunk >= EVENT_RECEIVER_MAX_CHUNKS)
+		{
+			fprintf(stderr, "EventReceiverTable: out of receiver slots\n");
+			abort();
+		}
+		if (!m_Chunks[chunk].load(std::memory_order_acquire))
+		{
+			Slot *slots = new Slot[EVENT_RECEIVER_CHUNK_SIZE];
+			for (int i = 0; i < EVENT_RECEIVER_CHUNK_SIZE; ++i)
+			{
+				slots[i].Generation.store(0, std::memory_order_relaxed);
+				slots[i].NextFree.store(Invalid, std::memory_order_relaxed);
+				slots[i].EventLoop.store(NULL, std::memory_order_relaxed);
+			}
+			Slot *expected = NULL;
+			if (!m_Chunks[chunk].compare_exchange_strong(expected, slots, std::memory_order_acq_rel))
+				delete[] slots; // Another thread installed this chunk first
+		}
+		return index;
+	}
+
+	std::atomic<uint64_t> m_FreeHead;
+	std::atomic<uint32_t> m_Size;
+	std::atomic<Slot *> m_Chunks[EVENT_RECEIVER_MAX_CHUNKS];
+
+	EventReceiverTable &operator=(const EventReceiverTable&) = delete;
+	EventReceiverTable(const EventReceiverTable&) = delete;
+
+};
+
+//! Trivially copyable reference to an EventReceiver, which can be checked for liveness from any thread
 struct EventReceiverHandle
 {
 public:
-	inline EventReceiverHandle() { }
-	inline bool alive() const { return m_Data && m_Data->Alive; }
+	inline EventReceiverHandle() : m_Index(EventReceiverTable::Invalid), m_Generation(0) { }
+	inline bool alive() const { return m_Index != EventReceiverTable::Invalid && EventReceiverTable::instance().slot(m_Index).Generation.load(std::memory_order_acquire) == m_Generation; }
 	inline operator bool() const { return alive(); }
-	inline EventLoop *eventLoop() const { return m_Data->EventLoop; }
-	inline bool immediate(const std::function<void()> &f) const { if (alive()) { eventLoop()->immediate(f); return true; } return false; }
+
+	//! Returns NULL if the receiver is gone
+	inline EventLoop *eventLoop() const
+	{
+		if (m_Index == EventReceiverTable::Invalid)
+			return NULL;
+		EventReceiverTable::Slot &slot = EventReceiverTable::instance().slot(m_Index);
+		EventLoop *loop = slot.EventLoop.load(std::memory_order_acquire);
+		// Recheck, the slot may have been recycled for another receiver while reading the loop
+		return slot.Generation.load(std::memory_order_acquire) == m_Generation ? loop : NULL;
+	}
+
+	inline bool immediate(const std::function<void()> &f) const { EventLoop *loop = eventLoop(); if (loop) { loop->immediate(f); return true; } return false; }
 
 private:
 	friend class EventReceiver;
 
-	struct Data
+	inline EventReceiverHandle(EventLoop *loop) { p_init(loop); }
+	inline void p_destroyed() { if (m_Index != EventReceiverTable::Invalid) { EventReceiverTable::instance().free(m_Index); p_invalidate(); } }
+	inline void p_invalidate() { m_Index = EventReceiverTable::Invalid; m_Generation = 0; }
+	inline void p_setEventLoop(EventLoop *loop) { if (m_Index != EventReceiverTable::Invalid) EventReceiverTable::instance().slot(m_Index).EventLoop.store(loop, std::memory_order_release); else p_init(loop); }
+	inline void p_init(EventLoop *loop)
 	{
-	public:
-		Data(::EventLoop *loop) : Alive(true), EventLoop(loop) { }
-		bool Alive;
-		::EventLoop *EventLoop;
-	};
-
-	inline EventReceiverHandle(EventLoop *loop) : m_Data(new Data(loop)) { }
-	inline void p_destroyed() { m_Data->Alive = false; }
-	inline void p_invalidate() { m_Data.reset(); }
-	inline void p_init(EventLoop *loop) { m_Data = std::shared_ptr<Data>(new Data(loop)); }
+		EventReceiverTable &table = EventReceiverTable::instance();
+		m_Index = table.allocate(loop);
+		m_Generation = table.slot(m_Index).Generation.load(std::memory_order_relaxed);
+	}
 
-	std::shared_ptr<Data> m_Data;
+	uint32_t m_Index;
+	uint32_t m_Generation;
 
 };
 
@@ -77,7 +210,7 @@ public:
 	inline const EventReceiver *eventReceiver() const { return this; }
 	inline EventReceiver *eventReceiver() { return this; }
 	inline const EventReceiverHandle &eventReceiverHandle() const { return m_Handle; }
-	inline EventLoop *eventLoop() const { return m_Handle.m_Data->EventLoop; }
+	inline EventLoop *eventLoop() const { return m_Handle.eventLoop(); }
 
 	EventReceiver(const EventReceiver &other)
 	{
@@ -87,7 +220,7 @@ public:
 	EventReceiver &operator=(const EventReceiver &other)
 	{
 		if (this != &other)
-			m_Handle.p_init(other.eventLoop());
+			m_Handle.p_setEventLoop(other.eventLoop()); // Same receiver, existing handles stay valid
 		return *this;
 	}
 
@@ -101,6 +234,7 @@ public:
 	{
 		if (this != &other)
 		{
+			m_Handle.p_destroyed();
 			m_Handle = other.m_Handle;
 			other.m_Handle.p_invalidate();
 		}
@@ -117,7 +251,7 @@ struct EventReceiverFunction
 public:
 	inline EventReceiverFunction() { }
 	inline EventReceiverFunction(const EventReceiver *receiver, const EventFunction &f) : m_Handle(receiver->eventReceiverHandle()), m_Function(f) { }
-	inline void immediate() const { m_Handle.immediate(m_Function); }
+	inline bool immediate() const { return m_Handle.immediate(m_Function); }
 
 private:
 	EventReceiverHandle m_Handle;
@@ -125,8 +259,6 @@ private:
 
 };
 
-#include "atomic_lock.h"
-
 template<typename ... TParams>
 struct EventCallbackFunction
 {
@@ -135,7 +267,10 @@ public:
 
 	inline EventCallbackFunction() { }
 	inline EventCallbackFunction(const EventReceiver *receiver, const FunctionType &f) : m_Handle(receiver->eventReceiverHandle()), m_Function(f) { }
-	inline bool immediate(TParams ... args) const { return m_Handle.immediate([=]() -> void { m_Function(args ...); }); }
+	inline bool immediate(TParams ... args) const { FunctionType f = m_Function; return m_Handle.immediate([f, args ...]() -> void { f(args ...); }); }
+
+	inline const EventReceiverHandle &eventReceiverHandle() const { return m_Handle; }
+	inline const FunctionType &function() const { return m_Function; }
 
 private:
 	EventReceiverHandle m_Handle;
@@ -143,6 +278,27 @@ private:
 
 };
 
+template<size_t ... TIndices>
+struct EventIndexSequence
+{
+
+};
+
+template<size_t TSize, size_t ... TIndices>
+struct EventMakeIndexSequence : EventMakeIndexSequence<TSize - 1, TSize - 1, TIndices ...>
+{
+
+};
+
+template<size_t ... TIndices>
+struct EventMakeIndexSequence<0, TIndices ...>
+{
+	typedef EventIndexSequence<TIndices ...> Type;
+};
+
+//! Callback list with any number of subscribers on any number of event loops
+//! Emitting does not lock, it reads an immutable snapshot of the subscribers which is replaced on subscribe (copy on write)
+//! Subscribers are grouped by event loop, an emit makes a single allocation for the arguments and a single post per loop
 template<class TFriend, typename ... TParams>
 struct EventCallback
 {
@@ -152,33 +308,227 @@ private:
 
 public:
 	typedef typename CallbackType::FunctionType FunctionType;
-	inline EventCallback() { }
 
-	void operator() (EventReceiver *receiver, FunctionType f)
+	inline EventCallback() : m_Snapshot(NULL), m_Parity(0), m_Dirty(false)
+	{
+		m_Readers[0].store(0, std::memory_order_relaxed);
+		m_Readers[1].store(0, std::memory_order_relaxed);
+	}
+
+	~EventCallback()
 	{
-		m_Lock.lock();
-		m_Callbacks.push_back(CallbackType(receiver, f));
-		m_Lock.unlock();
+		Snapshot *snapshot = m_Snapshot.load(std::memory_order_acquire);
+		if (snapshot)
+			snapshot->release();
+	}
+
+	void operator() (EventReceiver *receiver, FunctionType f) // thread-safe
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock);
+		Snapshot *next = copy(false);
+		EventLoop *loop = receiver->eventLoop();
+		size_t i = 0;
+		for (; i < next->Groups.size(); ++i)
+			if (next->Groups[i].Loop == loop)
+				break;
+		if (i == next->Groups.size())
+			next->Groups.push_back(Group(loop));
+		next->Groups[i].Callbacks.push_back(CallbackType(receiver, f));
+		publish(next);
 	}
 
 private:
-	void operator() (TParams ... args)
+	struct Group
+	{
+	public:
+		inline Group(EventLoop *loop) : Loop(loop) { }
+		EventLoop *Loop;
+		std::vector<CallbackType> Callbacks;
+	};
+
+	struct Snapshot
+	{
+	public:
+		inline Snapshot() : RefCount(1) { }
+		inline void retain() { RefCount.fetch_add(1, std::memory_order_relaxed); }
+		inline void release() { if (RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this; }
+		std::atomic_int RefCount;
+		std::vector<Group> Groups;
+	};
+
+	//! Arguments of one emit, shared by the posts to every loop
+	struct Emission
+	{
+	public:
+		inline Emission(Snapshot *snapshot, TParams ... args) : RefCount(1), Subscribers(snapshot), Args(args ...) { }
+		inline ~Emission() { Subscribers->release(); }
+		inline void retain() { RefCount.fetch_add(1, std::memory_order_relaxed); }
+		inline void release() { if (RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this; }
+		std::atomic_int RefCount;
+		Snapshot *Subscribers;
+		std::tuple<typename std::decay<TParams>::type ...> Args;
+	};
+
+	//! Runs on the target loop, calls the subscribers of one group which are still alive
+	struct EmitTask
+	{
+	public:
+#ifdef EVENT_LOOP_TRACE
+		inline EmitTask(Emission *emission, size_t group, uint64_t trace) : m_Emission(emission), m_Group(group), m_Trace(trace) { }
+		inline EmitTask(EmitTask &&other) noexcept : m_Emission(other.m_Emission), m_Group(other.m_Group), m_Trace(other.m_Trace) { other.m_Emission = NULL; }
+#else
+		inline EmitTask(Emission *emission, size_t group) : m_Emission(emission), m_Group(group) { }
+		inline EmitTask(EmitTask &&other) noexcept : m_Emission(other.m_Emission), m_Group(other.m_Group) { other.m_Emission = NULL; }
+#endif
+		inline ~EmitTask() { if (m_Emission) m_Emission->release(); }
+
+		void operator()()
+		{
+			const Group &group = m_Emission->Subscribers->Groups[m_Group];
+			for (size_t i = 0; i < group.Callbacks.size(); ++i)
+			{
+				const CallbackType &cb = group.Callbacks[i];
+				if (cb.eventReceiverHandle().alive())
+				{
+#ifdef EVENT_LOOP_TRACE
+					group.Loop->trace().start(EventTrace::Callback, m_Trace);
+					call(cb.function(), typename EventMakeIndexSequence<sizeof ... (TParams)>::Type());
+					group.Loop->trace().end(EventTrace::Callback, m_Trace);
+#else
+					call(cb.function(), typename EventMakeIndexSequence<sizeof ... (TParams)>::Type());
+#endif
+				}
+			}
+		}
+
+	private:
+		template<size_t ... TIndices>
+		inline void call(const FunctionType &f, EventIndexSequence<TIndices ...>)
+		{
+			f(std::get<TIndices>(m_Emission->Args) ...);
+		}
+
+		Emission *m_Emission;
+		size_t m_Group;
+#ifdef EVENT_LOOP_TRACE
+		uint64_t m_Trace; // Id of the emit in the trace of the target loop
+#endif
+
+		EmitTask &operator=(const EmitTask&) = delete;
+		EmitTask(const EmitTask&) = delete;
+
+	};
+
+	void operator() (TParams ... args) // thread-safe
 	{
-		m_Lock.lock();
-		for (int i = 0; i < m_Callbacks.size(); ++i)
+		static_assert(EventTask::fitsInline<EmitTask>(), "EmitTask must be stored inline, so that an emit does not allocate per loop");
+		Snapshot *snapshot = acquire();
+		if (!snapshot)
+			return;
+		Emission *emission = new Emission(snapshot, args ...);
+		bool dirty = false;
+		for (size_t i = 0; i < snapshot->Groups.size(); ++i)
 		{
-			const CallbackType &cb = m_Callbacks[i];
-			if (!cb.immediate(args ...))
+			const Group &group = snapshot->Groups[i];
+			bool alive = false;
+			for (size_t j = 0; j < group.Callbacks.size(); ++j)
+			{
+				if (group.Callbacks[j].eventReceiverHandle().alive())
+					alive = true;
+				else
+					dirty = true;
+			}
+			if (alive)
 			{
-				m_Callbacks.erase(m_Callbacks.begin() + i);
-				--i;
+				emission->retain();
+#ifdef EVENT_LOOP_TRACE
+				group.Loop->immediate(EmitTask(emission, i, group.Loop->trace().post(EventTrace::Callback)));
+#else
+				group.Loop->immediate(EmitTask(emission, i));
+#endif
 			}
 		}
-		m_Lock.unlock();
+		emission->release();
+		if (dirty)
+		{
+			m_Dirty.store(true, std::memory_order_relaxed);
+			compact();
+		}
 	}
 
-	AtomicLock m_Lock;
-	std::vector<CallbackType> m_Callbacks;
+	//! Takes a reference to the current snapshot without locking
+	//! Readers announce themselves on the counter of the current parity, and writers wait for the old parity to drain before releasing a replaced snapshot
+	Snapshot *acquire()
+	{
+		for (;;)
+		{
+			int parity = m_Parity.load();
+			m_Readers[parity].fetch_add(1);
+			if (m_Parity.load() != parity)
+			{
+				m_Readers[parity].fetch_sub(1, std::memory_order_release);
+				continue;
+			}
+			Snapshot *snapshot = m_Snapshot.load();
+			if (snapshot)
+				snapshot->retain();
+			m_Readers[parity].fetch_sub(1, std::memory_order_release);
+			return snapshot;
+		}
+	}
+
+	//! Copy of the current subscribers, only call while holding m_Lock
+	Snapshot *copy(bool compact)
+	{
+		Snapshot *next = new Snapshot();
+		Snapshot *current = m_Snapshot.load(std::memory_order_relaxed);
+		if (current)
+		{
+			for (size_t i = 0; i < current->Groups.size(); ++i)
+			{
+				const Group &group = current->Groups[i];
+				Group copy(group.Loop);
+				for (size_t j = 0; j < group.Callbacks.size(); ++j)
+					if (!compact || group.Callbacks[j].eventReceiverHandle().alive())
+						copy.Callbacks.push_back(group.Callbacks[j]);
+				if (!copy.Callbacks.empty())
+					next->Groups.push_back(std::move(copy));
+			}
+		}
+		return next;
+	}
+
+	//! Replace the snapshot, only call while holding m_Lock
+	void publish(Snapshot *next)
+	{
+		Snapshot *previous = m_Snapshot.exchange(next);
+		int parity = m_Parity.load(std::memory_order_relaxed);
+		m_Parity.store(parity ^ 1);
+		while (m_Readers[parity].load(std::memory_order_acquire))
+			std::this_thread::yield();
+		if (previous)
+			previous->release();
+	}
+
+	//! Drop dead subscribers, skipped if another thread is already modifying the list
+	void compact()
+	{
+		std::unique_lock<EventLoopLock> lock(m_Lock, std::try_to_lock);
+		if (!lock.owns_lock())
+			return;
+		if (!m_Dirty.exchange(false, std::memory_order_relaxed))
+			return;
+		publish(copy(true));
+	}
+
+	EventLoopLock m_Lock; // Writers
+	std::atomic<Snapshot *> m_Snapshot;
+	std::atomic_int m_Parity;
+	std::atomic_int m_Readers[2];
+	std::atomic_bool m_Dirty;
+
+	EventCallback &operator=(const EventCallback&) = delete;
+	EventCallback(const EventCallback&) = delete;
 
 };
 
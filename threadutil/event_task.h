@@ -0,0 +1,182 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_EVENT_TASK_H
+#define THREADUTIL_EVENT_TASK_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//! Move-only function wrapper for void(), stores small functors inline to avoid heap allocation when posting
+class EventTask
+{
+public:
+	static const size_t InlineSize = 48;
+
+	inline EventTask() : m_Ops(NULL)
+	{
+
+	}
+
+	inline EventTask(std::nullptr_t) : m_Ops(NULL)
+	{
+
+	}
+
+	template<class TFunc, class = typename std::enable_if<!std::is_same<typename std::decay<TFunc>::type, EventTask>::value>::type>
+	inline EventTask(TFunc &&f) : m_Ops(NULL)
+	{
+		init(std::forward<TFunc>(f));
+	}
+
+	inline EventTask(EventTask &&other) : m_Ops(other.m_Ops)
+	{
+		if (m_Ops)
+		{
+			m_Ops->Move(m_Storage, other.m_Storage);
+			other.m_Ops = NULL;
+		}
+	}
+
+	inline EventTask &operator=(EventTask &&other)
+	{
+		if (this != &other)
+		{
+			reset();
+			if (other.m_Ops)
+			{
+				m_Ops = other.m_Ops;
+				m_Ops->Move(m_Storage, other.m_Storage);
+				other.m_Ops = NULL;
+			}
+		}
+		return *this;
+	}
+
+	inline EventTask &operator=(std::nullptr_t)
+	{
+		reset();
+		return *this;
+	}
+
+	inline ~EventTask()
+	{
+		reset();
+	}
+
+	inline void operator()()
+	{
+		m_Ops->Invoke(m_Storage);
+	}
+
+	inline explicit operator bool() const { return m_Ops != NULL; }
+
+	//! Whether functors of this type are stored inline. They must be small enough, and moving them must be noexcept
+	template<class TFunctor>
+	static constexpr bool fitsInline()
+	{
+		return (sizeof(TFunctor) <= InlineSize)
+			&& (std::alignment_of<TFunctor>::value <= std::alignment_of<std::max_align_t>::value)
+			&& std::is_nothrow_move_constructible<TFunctor>::value;
+	}
+
+	inline void reset()
+	{
+		if (m_Ops)
+		{
+			m_Ops->Destroy(m_Storage);
+			m_Ops = NULL;
+		}
+	}
+
+private:
+	struct Ops
+	{
+		void (*Invoke)(void *storage);
+		void (*Move)(void *dst, void *src); // Move constructs into dst, destroys src
+		void (*Destroy)(void *storage);
+	};
+
+	template<class TFunc>
+	struct InlineOps
+	{
+		static void invoke(void *storage) { (*static_cast<TFunc *>(storage))(); }
+		static void move(void *dst, void *src) { TFunc *f = static_cast<TFunc *>(src); new (dst) TFunc(std::move(*f)); f->~TFunc(); }
+		static void destroy(void *storage) { static_cast<TFunc *>(storage)->~TFunc(); }
+		static const Ops Table;
+	};
+
+	template<class TFunc>
+	struct HeapOps
+	{
+		static void invoke(void *storage) { (**static_cast<TFunc **>(storage))(); }
+		static void move(void *dst, void *src) { *static_cast<TFunc **>(dst) = *static_cast<TFunc **>(src); }
+		static void destroy(void *storage) { delete *static_cast<TFunc **>(storage); }
+		static const Ops Table;
+	};
+
+	template<class TFunc>
+	inline void init(TFunc &&f)
+	{
+		typedef typename std::decay<TFunc>::type TFunctor;
+		initAs<TFunctor>(std::forward<TFunc>(f), std::integral_constant<bool, fitsInline<TFunctor>()>());
+	}
+
+	template<class TFunctor, class TFunc>
+	inline void initAs(TFunc &&f, std::true_type) // inline
+	{
+		new (m_Storage) TFunctor(std::forward<TFunc>(f));
+		m_Ops = &InlineOps<TFunctor>::Table;
+	}
+
+	template<class TFunctor, class TFunc>
+	inline void initAs(TFunc &&f, std::false_type) // heap
+	{
+		*reinterpret_cast<TFunctor **>(m_Storage) = new TFunctor(std::forward<TFunc>(f));
+		m_Ops = &HeapOps<TFunctor>::Table;
+	}
+
+	typename std::aligned_storage<InlineSize, std::alignment_of<std::max_align_t>::value>::type m_Storage[1];
+	const Ops *m_Ops;
+
+	EventTask &operator=(const EventTask&) = delete;
+	EventTask(const EventTask&) = delete;
+
+};
+
+template<class TFunc>
+const EventTask::Ops EventTask::InlineOps<TFunc>::Table = { &EventTask::InlineOps<TFunc>::invoke, &EventTask::InlineOps<TFunc>::move, &EventTask::InlineOps<TFunc>::destroy };
+
+template<class TFunc>
+const EventTask::Ops EventTask::HeapOps<TFunc>::Table = { &EventTask::HeapOps<TFunc>::invoke, &EventTask::HeapOps<TFunc>::move, &EventTask::HeapOps<TFunc>::destroy };
+
+#endif /* THREADUTIL_EVENT_TASK_H */
+
+/* end of file */
@@ -0,0 +1,257 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#ifndef THREADUTIL_EVENT_TRACE_H
+#define THREADUTIL_EVENT_TRACE_H
+
+#ifndef EVENT_LOOP_TRACE_SIZE
+#define EVENT_LOOP_TRACE_SIZE 65536 // Events kept per loop, must be a power of two. Each event takes 32 bytes
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+//! Ring buffer of the most recent post, start and end events of one event loop, written lock-free from any thread
+//! Events can be written out as Chrome trace event JSON, which opens in Perfetto or chrome://tracing
+//! Each post is linked to the start of the function it posted by a flow arrow, which shows who posted what
+class EventTrace
+{
+public:
+	enum Phase
+	{
+		Post,
+		Start,
+		End,
+	};
+
+	enum Source
+	{
+		Immediate,
+		Timer,
+		Thread, // Blocking work on the thread pool
+		Callback,
+	};
+
+	EventTrace() : m_Events(new Event[EVENT_LOOP_TRACE_SIZE]), m_Next(0), m_LoopThread(0)
+	{
+		static std::atomic<uint32_t> s_Index(0);
+		m_Index = ++s_Index;
+		for (size_t i = 0; i < EVENT_LOOP_TRACE_SIZE; ++i)
+			m_Events[i].Sequence.store(0, std::memory_order_relaxed);
+		epoch();
+	}
+
+	~EventTrace()
+	{
+		delete[] m_Events;
+	}
+
+	//! Record the posting of a function, returns the id to pass to start and end
+	inline uint64_t post(Source source) // thread-safe
+	{
+		return record(Post, source, 0);
+	}
+
+	//! Record a post under an id chosen by the caller, such as the key of a timer
+	inline void post(Source source, uint64_t id) // thread-safe
+	{
+		record(Post, source, id);
+	}
+
+	inline void start(Source source, uint64_t id) // thread-safe
+	{
+		record(Start, source, id);
+	}
+
+	inline void end(Source source, uint64_t id) // thread-safe
+	{
+		record(End, source, id);
+	}
+
+	//! Name the calling thread as the thread of this loop in the trace
+	inline void setLoopThread() // thread-safe
+	{
+		m_LoopThread.store(threadId(), std::memory_order_relaxed);
+	}
+
+	//! Write the events currently in the buffer as JSON objects, separated by commas. Set first before the first call
+	void write(FILE *f, bool &first) const // thread-safe
+	{
+		static const char *const names[] = { "immediate", "timer", "thread", "callback" };
+		uint32_t loopThread = m_LoopThread.load(std::memory_order_relaxed);
+		if (loopThread)
+		{
+			fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"EventLoop %u\"}}", first ? "" : ",", loopThread, m_Index);
+			first = false;
+		}
+		std::vector<Record> records;
+		snapshot(records);
+		int64_t base = epoch();
+		for (size_t i = 0; i < records.size(); ++i)
+		{
+			const Record &r = records[i];
+			const char *name = names[r.Origin];
+			uint64_t flow = ((uint64_t)m_Index << 56) | ((uint64_t)r.Origin << 52) | (r.Id & 0xFFFFFFFFFFFFFULL); // Unique across loops in one file, written as a string since JSON numbers lose precision past 2^53
+			int64_t ns = (int64_t)r.Time - base;
+			long long us = (long long)(ns / 1000);
+			int frac = (int)(ns % 1000);
+			if (frac < 0)
+			{
+				--us;
+				frac += 1000;
+			}
+			const char *sep = first ? "" : ",";
+			first = false;
+			switch (r.Step)
+			{
+			case Post:
+				fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"s\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,\"ts\":%lld.%03d}", sep, name, name, (unsigned long long)flow, r.Thread, us, frac);
+				break;
+			case Start:
+				fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"B\",\"pid\":1,\"tid\":%u,\"ts\":%lld.%03d}", sep, name, name, r.Thread, us, frac);
+				fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"f\",\"bp\":\"e\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,\"ts\":%lld.%03d}", name, name, (unsigned long long)flow, r.Thread, us, frac);
+				break;
+			case End:
+				fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"E\",\"pid\":1,\"tid\":%u,\"ts\":%lld.%03d}", sep, name, name, r.Thread, us, frac);
+				break;
+			}
+		}
+	}
+
+	//! Write the events of the given traces into one JSON file, returns false if the file could not be opened
+	static bool dump(const char *path, const EventTrace *const *traces, size_t count) // thread-safe
+	{
+		FILE *f = fopen(path, "w");
+		if (!f)
+			return false;
+		fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+		bool first = true;
+		for (size_t i = 0; i < count; ++i)
+			traces[i]->write(f, first);
+		fprintf(f, "\n]}\n");
+		return fclose(f) == 0;
+	}
+
+private:
+	struct Event
+	{
+	public:
+		std::atomic<uint64_t> Sequence; // Odd while the event is being written
+		std::atomic<uint64_t> Time; // Nanoseconds of the steady clock
+		std::atomic<uint64_t> Id;
+		std::atomic<uint32_t> Thread;
+		std::atomic<uint32_t> Kind; // Phase in the low byte, source in the next one
+	};
+
+	struct Record
+	{
+	public:
+		uint64_t Time;
+		uint64_t Id;
+		uint32_t Thread;
+		Phase Step;
+		Source Origin;
+		inline bool operator <(const Record &o) const { return Time < o.Time; }
+	};
+
+	inline uint64_t record(Phase phase, Source source, uint64_t id)
+	{
+		uint64_t n = m_Next.fetch_add(1, std::memory_order_relaxed);
+		Event &e = m_Events[n & (EVENT_LOOP_TRACE_SIZE - 1)];
+		e.Sequence.store(n * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		if (!id)
+			id = n + 1;
+		e.Time.store((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+		e.Id.store(id, std::memory_order_relaxed);
+		e.Thread.store(threadId(), std::memory_order_relaxed);
+		e.Kind.store((uint32_t)phase | ((uint32_t)source << 8), std::memory_order_relaxed);
+		e.Sequence.store(n * 2 + 2, std::memory_order_release);
+		return id;
+	}
+
+	//! Copy out the complete events, skipping any that are being overwritten
+	void snapshot(std::vector<Record> &records) const
+	{
+		uint64_t next = m_Next.load(std::memory_order_acquire);
+		uint64_t first = next > EVENT_LOOP_TRACE_SIZE ? next - EVENT_LOOP_TRACE_SIZE : 0;
+		records.reserve((size_t)(next - first));
+		for (uint64_t n = first; n < next; ++n)
+		{
+			const Event &e = m_Events[n & (EVENT_LOOP_TRACE_SIZE - 1)];
+			uint64_t sequence = e.Sequence.load(std::memory_order_acquire);
+			if (sequence != n * 2 + 2)
+				continue;
+			Record r;
+			r.Time = e.Time.load(std::memory_order_relaxed);
+			r.Id = e.Id.load(std::memory_order_relaxed);
+			r.Thread = e.Thread.load(std::memory_order_relaxed);
+			uint32_t kind = e.Kind.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (e.Sequence.load(std::memory_order_relaxed) != sequence)
+				continue;
+			r.Step = (Phase)(kind & 0xFF);
+			r.Origin = (Source)((kind >> 8) & 0xFF);
+			records.push_back(r);
+		}
+		std::stable_sort(records.begin(), records.end());
+	}
+
+	//! Small number identifying the calling thread in the trace
+	static inline uint32_t threadId()
+	{
+		static std::atomic<uint32_t> s_Next(0);
+		static thread_local uint32_t s_Id = 0;
+		if (!s_Id)
+			s_Id = ++s_Next;
+		return s_Id;
+	}
+
+	//! Time zero of all traces in the process, in nanoseconds of the steady clock
+	static inline int64_t epoch()
+	{
+		static const int64_t s_Epoch = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		return s_Epoch;
+	}
+
+	Event *m_Events;
+	std::atomic<uint64_t> m_Next;
+	std::atomic<uint32_t> m_LoopThread;
+	uint32_t m_Index;
+
+	EventTrace &operator=(const EventTrace&) = delete;
+	EventTrace(const EventTrace&) = delete;
+
+};
+
+#endif /* THREADUTIL_EVENT_TRACE_H */
+
+/* end of file */
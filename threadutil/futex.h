@@ -0,0 +1,76 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_FUTEX_H
+#define THREADUTIL_FUTEX_H
+
+#ifdef __linux__
+#define THREADUTIL_FUTEX
+#endif
+
+#ifdef THREADUTIL_FUTEX
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+
+//! Block while the value at addr equals expected, may wake spuriously
+inline void futexWait(std::atomic<int> *addr, int expected)
+{
+	syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+//! Block while the value at addr equals expected, or until the timeout expires, may wake spuriously
+template<class rep, class period>
+inline void futexWait(std::atomic<int> *addr, int expected, const std::chrono::duration<rep, period> &timeout)
+{
+	std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout);
+	if (ns <= std::chrono::nanoseconds::zero())
+		return;
+	struct timespec ts;
+	ts.tv_sec = (time_t)(ns.count() / 1000000000);
+	ts.tv_nsec = (long)(ns.count() % 1000000000);
+	syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAIT_PRIVATE, expected, &ts, NULL, 0);
+}
+
+//! Wake up to count threads blocked on addr
+inline void futexWake(std::atomic<int> *addr, int count)
+{
+	syscall(SYS_futex, reinterpret_cast<int *>(addr), FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif /* THREADUTIL_FUTEX */
+
+#endif /* THREADUTIL_FUTEX_H */
+
+/* end of file */
@@ -0,0 +1,502 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_FUTURE_H
+#define THREADUTIL_FUTURE_H
+
+#include <assert.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "event_loop.h"
+#include "atomic_lock.h"
+
+//! Value type of Future<void>
+struct FutureVoid
+{
+
+};
+
+template<class T>
+struct FutureValue
+{
+	typedef T Type;
+};
+
+template<>
+struct FutureValue<void>
+{
+	typedef FutureVoid Type;
+};
+
+template<class T> class Future;
+template<class T> class Promise;
+template<class T> struct FutureAwaiter;
+
+//! State shared between a promise and its future, allocated from the pool of the promise's event loop
+//! Holds the value once set, and at most one continuation which is posted to its loop when the value is set
+//! A continuation usually holds a reference to its state, so when the value can no longer be set the state is broken and the continuation destroyed
+template<class T>
+class FutureState
+{
+public:
+	typedef typename FutureValue<T>::Type ValueType;
+
+	static FutureState *create(EventLoop &loop)
+	{
+		return new (loop.allocate(sizeof(FutureState))) FutureState(loop);
+	}
+
+	inline void retain() // thread-safe
+	{
+		m_RefCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	inline void release() // thread-safe
+	{
+		if (m_RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			EventLoop &loop = m_Loop;
+			this->~FutureState();
+			loop.deallocate(this, sizeof(FutureState));
+		}
+	}
+
+	inline EventLoop &eventLoop() const { return m_Loop; }
+
+	//! Only the first value is kept, setting a value twice is a bug
+	template<class TValue>
+	void setValue(TValue &&value) // thread-safe
+	{
+		EventLoop *target;
+		EventTask continuation;
+		; {
+			std::unique_lock<AtomicLock> lock(m_Lock);
+			assert(!m_Ready);
+			if (m_Ready)
+				return;
+			new (&m_Storage) ValueType(std::forward<TValue>(value));
+			m_Ready = true;
+			target = m_Target;
+			continuation = std::move(m_Continuation);
+		}
+		if (continuation)
+			target->immediate(std::move(continuation));
+	}
+
+	//! Post f to the given loop once the value is set, f may then take the value. If the state is broken, f is destroyed without running
+	void continueWith(EventLoop &loop, EventTask &&f) // thread-safe
+	{
+		; {
+			std::unique_lock<AtomicLock> lock(m_Lock);
+			if (m_Broken)
+			{
+				lock.unlock();
+				f = nullptr; // Destroy outside the lock
+				return;
+			}
+			if (!m_Ready)
+			{
+				m_Target = &loop;
+				m_Continuation = std::move(f);
+				return;
+			}
+		}
+		loop.immediate(std::move(f));
+	}
+
+	//! The value will never be set, destroys the continuation and any continuation added later. Does nothing once the value is set
+	void abandon() // thread-safe
+	{
+		EventTask continuation;
+		; {
+			std::unique_lock<AtomicLock> lock(m_Lock);
+			if (m_Ready)
+				return;
+			m_Broken = true;
+			continuation = std::move(m_Continuation);
+		}
+	}
+
+	//! Nobody is waiting for the value anymore, destroys the continuation without breaking the state
+	void dropContinuation() // thread-safe
+	{
+		EventTask continuation;
+		; {
+			std::unique_lock<AtomicLock> lock(m_Lock);
+			continuation = std::move(m_Continuation);
+		}
+	}
+
+	inline bool ready() // thread-safe
+	{
+		std::unique_lock<AtomicLock> lock(m_Lock);
+		return m_Ready;
+	}
+
+	//! Only valid once ready
+	inline ValueType &value() { return *reinterpret_cast<ValueType *>(&m_Storage); }
+
+private:
+	inline FutureState(EventLoop &loop) : m_Loop(loop), m_RefCount(1), m_Ready(false), m_Broken(false), m_Target(NULL)
+	{
+
+	}
+
+	inline ~FutureState()
+	{
+		if (m_Ready)
+			value().~ValueType();
+	}
+
+	EventLoop &m_Loop;
+	std::atomic_int m_RefCount;
+	AtomicLock m_Lock;
+	bool m_Ready;
+	bool m_Broken; // Abandoned before the value was set
+	EventLoop *m_Target;
+	EventTask m_Continuation;
+	typename std::aligned_storage<sizeof(ValueType), std::alignment_of<ValueType>::value>::type m_Storage;
+
+	FutureState &operator=(const FutureState&) = delete;
+	FutureState(const FutureState&) = delete;
+
+};
+
+//! Result type of a continuation taking the value of Future<T>
+template<class T, class TFunc>
+struct FutureResult
+{
+	typedef decltype(std::declval<TFunc &>()(std::declval<T>())) Type;
+};
+
+template<class TFunc>
+struct FutureResult<void, TFunc>
+{
+	typedef decltype(std::declval<TFunc &>()()) Type;
+};
+
+//! Calls a continuation with the value of the source state, and sets its result on the next state
+template<class T, class TResult>
+struct FutureInvoke
+{
+	template<class TFunc>
+	static inline void call(TFunc &f, FutureState<T> *source, FutureState<TResult> *next) { next->setValue(f(std::move(source->value()))); }
+};
+
+template<class T>
+struct FutureInvoke<T, void>
+{
+	template<class TFunc>
+	static inline void call(TFunc &f, FutureState<T> *source, FutureState<void> *next) { f(std::move(source->value())); next->setValue(FutureVoid()); }
+};
+
+template<class TResult>
+struct FutureInvoke<void, TResult>
+{
+	template<class TFunc>
+	static inline void call(TFunc &f, FutureState<void> *source, FutureState<TResult> *next) { next->setValue(f()); }
+};
+
+template<>
+struct FutureInvoke<void, void>
+{
+	template<class TFunc>
+	static inline void call(TFunc &f, FutureState<void> *source, FutureState<void> *next) { f(); next->setValue(FutureVoid()); }
+};
+
+//! Read-only end of a promise. Move only, a future can be continued once
+template<class T>
+class Future
+{
+public:
+	typedef typename FutureValue<T>::Type ValueType;
+
+	inline Future() : m_State(NULL) { }
+	inline Future(Future &&other) : m_State(other.m_State) { other.m_State = NULL; }
+	inline ~Future() { if (m_State) m_State->release(); }
+
+	inline Future &operator=(Future &&other)
+	{
+		if (this != &other)
+		{
+			if (m_State)
+				m_State->release();
+			m_State = other.m_State;
+			other.m_State = NULL;
+		}
+		return *this;
+	}
+
+	inline bool valid() const { return m_State != NULL; }
+	inline bool ready() const { return m_State && m_State->ready(); } // thread-safe
+
+	//! Run f on the given loop with the value once it is set, returns the future of the result of f
+	//! The state of the returned future is allocated from the pool of that loop
+	template<class TFunc>
+	Future<typename FutureResult<T, TFunc>::Type> then(EventLoop &loop, TFunc f)
+	{
+		typedef typename FutureResult<T, TFunc>::Type TResult;
+		FutureState<TResult> *next = FutureState<TResult>::create(loop);
+		next->retain(); // One for the continuation, one for the returned future
+		FutureState<T> *source = m_State;
+		m_State = NULL;
+		source->continueWith(loop, EventTask(Then<TFunc, TResult>(source, next, std::move(f))));
+		return Future<TResult>(next);
+	}
+
+	//! Run f on the loop of the promise
+	template<class TFunc>
+	Future<typename FutureResult<T, TFunc>::Type> then(TFunc f)
+	{
+		return then(m_State->eventLoop(), std::move(f));
+	}
+
+private:
+	template<class TAny> friend class Future;
+	template<class TAny> friend class Promise;
+	template<class TAny> friend struct FutureAwaiter;
+	template<class TAny> friend Future<std::vector<typename FutureValue<TAny>::Type> > whenAll(EventLoop &loop, std::vector<Future<TAny> > &&futures);
+	template<class TAny> friend Future<std::pair<size_t, typename FutureValue<TAny>::Type> > whenAny(EventLoop &loop, std::vector<Future<TAny> > &&futures);
+
+	inline explicit Future(FutureState<T> *state) : m_State(state) { }
+
+	inline FutureState<T> *detach() { FutureState<T> *state = m_State; m_State = NULL; return state; }
+
+	template<class TFunc, class TResult>
+	struct Then
+	{
+	public:
+		inline Then(FutureState<T> *source, FutureState<TResult> *next, TFunc &&f) : m_Source(source), m_Next(next), m_Function(std::move(f)) { }
+		inline Then(Then &&other) noexcept(std::is_nothrow_move_constructible<TFunc>::value) : m_Source(other.m_Source), m_Next(other.m_Next), m_Function(std::move(other.m_Function)) { other.m_Source = NULL; other.m_Next = NULL; }
+		inline ~Then() { if (m_Source) m_Source->release(); if (m_Next) { m_Next->abandon(); m_Next->release(); } } // Breaks the next state if this never ran
+		inline void operator()() { FutureInvoke<T, TResult>::call(m_Function, m_Source, m_Next); }
+
+	private:
+		FutureState<T> *m_Source;
+		FutureState<TResult> *m_Next;
+		TFunc m_Function;
+
+		Then &operator=(const Then&) = delete;
+		Then(const Then&) = delete;
+
+	};
+
+	FutureState<T> *m_State;
+
+	Future &operator=(const Future&) = delete;
+	Future(const Future&) = delete;
+
+};
+
+//! Write end of a future, the value may be set from any thread
+template<class T>
+class Promise
+{
+public:
+	typedef typename FutureValue<T>::Type ValueType;
+
+	//! The shared state is allocated from the pool of the given loop, which is also where then() without a loop continues
+	inline explicit Promise(EventLoop &loop) : m_State(FutureState<T>::create(loop)) { }
+	inline Promise(Promise &&other) : m_State(other.m_State) { other.m_State = NULL; }
+	inline ~Promise() { if (m_State) { m_State->abandon(); m_State->release(); } }
+
+	//! Only call once
+	inline Future<T> future()
+	{
+		m_State->retain();
+		return Future<T>(m_State);
+	}
+
+	//! Only call once, a second value is ignored
+	template<class TValue>
+	inline void setValue(TValue &&value) // thread-safe
+	{
+		m_State->setValue(std::forward<TValue>(value));
+	}
+
+	inline void setValue() // thread-safe, for Promise<void>
+	{
+		m_State->setValue(FutureVoid());
+	}
+
+private:
+	FutureState<T> *m_State;
+
+	Promise &operator=(const Promise&) = delete;
+	Promise(const Promise&) = delete;
+
+};
+
+//! Future of all values, in the order of the given futures. Joins on the given loop
+template<class T>
+Future<std::vector<typename FutureValue<T>::Type> > whenAll(EventLoop &loop, std::vector<Future<T> > &&futures)
+{
+	typedef typename FutureValue<T>::Type ValueType;
+	typedef std::vector<ValueType> ResultType;
+
+	struct Join
+	{
+	public:
+		inline Join(FutureState<ResultType> *next, size_t size) : RefCount((int)size), Remaining((int)size), Next(next), Values(size) { }
+		inline void release()
+		{
+			if (RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				FutureState<ResultType> *next = Next;
+				this->~Join();
+				next->eventLoop().deallocate(this, sizeof(Join));
+				next->abandon(); // One of the futures was abandoned
+				next->release();
+			}
+		}
+		std::atomic_int RefCount;
+		std::atomic_int Remaining;
+		FutureState<ResultType> *Next;
+		ResultType Values;
+	};
+
+	struct Arrive
+	{
+	public:
+		inline Arrive(Join *join, FutureState<T> *source, size_t index) : m_Join(join), m_Source(source), m_Index(index) { }
+		inline Arrive(Arrive &&other) noexcept : m_Join(other.m_Join), m_Source(other.m_Source), m_Index(other.m_Index) { other.m_Join = NULL; other.m_Source = NULL; }
+		inline ~Arrive() { if (m_Source) m_Source->release(); if (m_Join) m_Join->release(); }
+		void operator()()
+		{
+			m_Join->Values[m_Index] = std::move(m_Source->value());
+			if (m_Join->Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				m_Join->Next->setValue(std::move(m_Join->Values));
+		}
+
+	private:
+		Join *m_Join;
+		FutureState<T> *m_Source;
+		size_t m_Index;
+
+	};
+
+	FutureState<ResultType> *next = FutureState<ResultType>::create(loop);
+	Future<ResultType> res(next);
+	if (futures.empty())
+	{
+		next->setValue(ResultType());
+		return res;
+	}
+	next->retain(); // Held by the join
+	Join *join = new (loop.allocate(sizeof(Join))) Join(next, futures.size());
+	for (size_t i = 0; i < futures.size(); ++i)
+	{
+		FutureState<T> *source = futures[i].detach();
+		source->continueWith(loop, EventTask(Arrive(join, source, i)));
+	}
+	return res;
+}
+
+//! Future of the index and value of the first of the given futures to be set. Joins on the given loop
+template<class T>
+Future<std::pair<size_t, typename FutureValue<T>::Type> > whenAny(EventLoop &loop, std::vector<Future<T> > &&futures)
+{
+	typedef typename FutureValue<T>::Type ValueType;
+	typedef std::pair<size_t, ValueType> ResultType;
+
+	struct Join
+	{
+	public:
+		inline Join(FutureState<ResultType> *next, size_t size) : RefCount((int)size), Done(false), Next(next), Sources(size) { }
+		inline ~Join()
+		{
+			for (size_t i = 0; i < Sources.size(); ++i)
+				Sources[i]->release();
+		}
+		inline void release()
+		{
+			if (RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				FutureState<ResultType> *next = Next;
+				this->~Join();
+				next->eventLoop().deallocate(this, sizeof(Join));
+				next->abandon(); // All of the futures were abandoned
+				next->release();
+			}
+		}
+		std::atomic_int RefCount;
+		std::atomic_bool Done;
+		FutureState<ResultType> *Next;
+		std::vector<FutureState<T> *> Sources; // Retained, so that the continuations of the losers can be dropped
+	};
+
+	struct Arrive
+	{
+	public:
+		inline Arrive(Join *join, FutureState<T> *source, size_t index) : m_Join(join), m_Source(source), m_Index(index) { }
+		inline Arrive(Arrive &&other) noexcept : m_Join(other.m_Join), m_Source(other.m_Source), m_Index(other.m_Index) { other.m_Join = NULL; other.m_Source = NULL; }
+		inline ~Arrive() { if (m_Source) m_Source->release(); if (m_Join) m_Join->release(); }
+		void operator()()
+		{
+			if (!m_Join->Done.exchange(true, std::memory_order_acq_rel))
+			{
+				m_Join->Next->setValue(ResultType(m_Index, std::move(m_Source->value())));
+				for (size_t i = 0; i < m_Join->Sources.size(); ++i)
+				{
+					if (i != m_Index)
+						m_Join->Sources[i]->dropContinuation(); // Destroys the continuation of the losers, which releases their hold on the join
+				}
+			}
+		}
+
+	private:
+		Join *m_Join;
+		FutureState<T> *m_Source;
+		size_t m_Index;
+
+	};
+
+	FutureState<ResultType> *next = FutureState<ResultType>::create(loop);
+	Future<ResultType> res(next);
+	if (futures.empty())
+		return res; // Never set
+	next->retain(); // Held by the join
+	Join *join = new (loop.allocate(sizeof(Join))) Join(next, futures.size());
+	for (size_t i = 0; i < futures.size(); ++i)
+	{
+		join->Sources[i] = futures[i].detach();
+		join->Sources[i]->retain(); // One for the join, one for the continuation
+	}
+	for (size_t i = 0; i < futures.size(); ++i)
+		join->Sources[i]->continueWith(loop, EventTask(Arrive(join, join->Sources[i], i)));
+	return res;
+}
+
+#endif /* THREADUTIL_FUTURE_H */
+
+/* end of file */
@@ -0,0 +1,149 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_MPSC_QUEUE_H
+#define THREADUTIL_MPSC_QUEUE_H
+
+#include <atomic>
+#include <new>
+#include <utility>
+
+#include "block_pool.h"
+
+//! Lock-free multiple producer, single consumer queue (Vyukov style node queue)
+//! Producers only do a single atomic exchange, the consumer never does an atomic read-modify-write
+//! Nodes are taken from the given block pool if any, so pushing does not go through the heap
+template<class T>
+class MpscQueue
+{
+public:
+	inline MpscQueue(BlockPool *pool = NULL) : m_Tail(&m_Stub), m_Pool(pool)
+	{
+		m_Head.store(&m_Stub, std::memory_order_relaxed);
+	}
+
+	~MpscQueue()
+	{
+		clear();
+		freeNode(m_Tail);
+	}
+
+	inline void push(const T &value) // thread-safe
+	{
+		Node *node = m_Pool ? new (m_Pool->allocate(sizeof(Node))) Node(value) : new Node(value);
+		pushNode(node);
+	}
+
+	inline void push(T &&value) // thread-safe
+	{
+		Node *node = m_Pool ? new (m_Pool->allocate(sizeof(Node))) Node(std::move(value)) : new Node(std::move(value));
+		pushNode(node);
+	}
+
+	//! Only call before the first push
+	inline void setBlockPool(BlockPool *pool)
+	{
+		m_Pool = pool;
+	}
+
+	//! Only call from the consumer thread. May return false while a producer is halfway through a push, the producer is expected to poke the consumer afterwards
+	inline bool tryPop(T &value)
+	{
+		Node *tail = m_Tail;
+		Node *next = tail->Next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+		value = std::move(next->Value);
+		next->Value = T();
+		m_Tail = next; // Next becomes the new stub
+		freeNode(tail);
+		return true;
+	}
+
+	//! Only call from the consumer thread
+	inline bool empty() const
+	{
+		return !m_Tail->Next.load(std::memory_order_acquire);
+	}
+
+	//! Only call from the consumer thread. Returns the number of values dropped
+	size_t clear()
+	{
+		size_t res = 0;
+		T value;
+		while (tryPop(value))
+			++res;
+		return res;
+	}
+
+private:
+	struct Node
+	{
+	public:
+		Node() : Next(NULL) { }
+		Node(const T &value) : Next(NULL), Value(value) { }
+		Node(T &&value) : Next(NULL), Value(std::move(value)) { }
+		std::atomic<Node *> Next;
+		T Value;
+	};
+
+	inline void freeNode(Node *node)
+	{
+		if (node == &m_Stub)
+			return; // Initial stub is part of the queue
+		if (m_Pool)
+		{
+			node->~Node();
+			m_Pool->deallocate(node, sizeof(Node));
+		}
+		else
+		{
+			delete node;
+		}
+	}
+
+	inline void pushNode(Node *node)
+	{
+		Node *prev = m_Head.exchange(node, std::memory_order_acq_rel);
+		prev->Next.store(node, std::memory_order_release);
+	}
+
+	std::atomic<Node *> m_Head; // Producers
+	char m_Padding[64 - sizeof(std::atomic<Node *>)];
+	Node *m_Tail; // Consumer
+	Node m_Stub;
+	BlockPool *m_Pool;
+
+	MpscQueue &operator=(const MpscQueue&) = delete;
+	MpscQueue(const MpscQueue&) = delete;
+
+};
+
+#endif /* THREADUTIL_MPSC_QUEUE_H */
+
+/* end of file */
@@ -0,0 +1,144 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_SEQ_LOCK_H
+#define THREADUTIL_SEQ_LOCK_H
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+
+#include "atomic_lock.h"
+#include "cpu_pause.h"
+
+//! Sequence lock holding a small trivially copyable value, for data that is read far more often than written
+//! Readers never write shared memory, they copy the value and retry when a write happened in between
+//! Writers are serialized by an AtomicLock and never wait for readers
+template<class T>
+class SeqLock
+{
+public:
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock requires a trivially copyable type");
+
+	inline SeqLock() : m_Sequence(0)
+	{
+		T value = T();
+		storeWords(value);
+	}
+
+	inline SeqLock(const T &value) : m_Sequence(0)
+	{
+		storeWords(value);
+	}
+
+	//! Consistent snapshot of the value, spins while a write is in progress
+	inline T load() const // thread-safe
+	{
+		T value;
+		while (!tryLoad(value))
+			cpuPause();
+		return value;
+	}
+
+	//! Single attempt at a consistent snapshot, returns false if a write was in progress or happened during the copy
+	inline bool tryLoad(T &value) const // thread-safe
+	{
+		unsigned sequence = m_Sequence.load(std::memory_order_acquire);
+		if (sequence & 1)
+			return false;
+		loadWords(value);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return m_Sequence.load(std::memory_order_relaxed) == sequence;
+	}
+
+	inline void store(const T &value) // thread-safe
+	{
+		std::unique_lock<AtomicLock> lock(m_Lock);
+		beginWrite();
+		storeWords(value);
+		endWrite();
+	}
+
+	//! Modify the value in place, f receives a T & and runs while writers are locked out
+	template<class TFunc>
+	inline void update(TFunc f) // thread-safe
+	{
+		std::unique_lock<AtomicLock> lock(m_Lock);
+		T value;
+		loadWords(value);
+		f(value);
+		beginWrite();
+		storeWords(value);
+		endWrite();
+	}
+
+private:
+	typedef size_t Word;
+	enum { Words = (sizeof(T) + sizeof(Word) - 1) / sizeof(Word) };
+
+	inline void beginWrite()
+	{
+		m_Sequence.store(m_Sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	inline void endWrite()
+	{
+		m_Sequence.store(m_Sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// The value is kept as atomic words, so concurrent reads during a write are not a data race
+	inline void loadWords(T &value) const
+	{
+		Word words[Words];
+		for (int i = 0; i < Words; ++i)
+			words[i] = m_Words[i].load(std::memory_order_relaxed);
+		memcpy(&value, words, sizeof(T));
+	}
+
+	inline void storeWords(const T &value)
+	{
+		Word words[Words] = { };
+		memcpy(words, &value, sizeof(T));
+		for (int i = 0; i < Words; ++i)
+			m_Words[i].store(words[i], std::memory_order_relaxed);
+	}
+
+	std::atomic<unsigned> m_Sequence;
+	std::atomic<Word> m_Words[Words];
+	AtomicLock m_Lock;
+
+	SeqLock &operator=(const SeqLock&) = delete;
+	SeqLock(const SeqLock&) = delete;
+
+};
+
+#endif /* THREADUTIL_SEQ_LOCK_H */
+
+/* end of file */
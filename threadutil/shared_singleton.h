@@ -29,7 +29,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef THREADUTIL_SHARED_SINGLETON_H
 #define THREADUTIL_SHARED_SINGLETON_H
 
-#include "atomic_rw_lock.h"
+#include "atomic_br_lock.h"
 
 //! Purpose is to have a singleton which is reference counted, so it gets destroyed when no longer in use
 template<class TClass>
@@ -141,7 +141,7 @@ private:
 		
 		std::atomic_int RefCount;
 		std::atomic<TClass *> Instance;
-		AtomicRWLock Lock;
+		AtomicBRLock Lock;
 	};
 	
 	static SingletonStatic s_SingletonStatic;
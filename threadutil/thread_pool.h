@@ -0,0 +1,163 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_THREAD_POOL_H
+#define THREADUTIL_THREAD_POOL_H
+
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+#include "event_task.h"
+
+struct ThreadPoolStats
+{
+	size_t Threads; // Number of started threads
+	size_t Busy; // Number of threads running a function
+	size_t Queued; // Number of functions waiting for a thread
+	uint64_t Completed; // Number of functions that finished
+	size_t PeakThreads;
+	size_t PeakQueued;
+};
+
+//! Pool of threads for blocking work. Threads are started on demand up to the maximum, and then reused
+class ThreadPool
+{
+public:
+	ThreadPool(size_t maxThreads = 0) : m_MaxThreads(maxThreads ? maxThreads : defaultThreads()), m_Idle(0), m_Busy(0), m_Completed(0), m_PeakThreads(0), m_PeakQueued(0), m_Stopping(false)
+	{
+
+	}
+
+	//! Runs the functions that are still queued, and joins all threads
+	~ThreadPool()
+	{
+		; {
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Stopping = true;
+			m_Cond.notify_all();
+		}
+		for (size_t i = 0; i < m_Threads.size(); ++i)
+			m_Threads[i].join();
+	}
+
+	//! Maximum number of threads, does not stop threads that are already running
+	void setMaxThreads(size_t maxThreads) // thread-safe
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_MaxThreads = maxThreads ? maxThreads : defaultThreads();
+	}
+
+	template<class TFunc> void push(TFunc &&f) // thread-safe
+	{
+		EventTask task(std::forward<TFunc>(f));
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Queue.push_back(std::move(task));
+		if (m_Queue.size() > m_PeakQueued)
+			m_PeakQueued = m_Queue.size();
+		if (m_Queue.size() <= m_Idle)
+		{
+			m_Cond.notify_one(); // Enough idle threads to pick up the queue
+		}
+		else if (m_Threads.size() < m_MaxThreads)
+		{
+			m_Threads.push_back(std::thread(&ThreadPool::worker, this));
+			if (m_Threads.size() > m_PeakThreads)
+				m_PeakThreads = m_Threads.size();
+		}
+	}
+
+	ThreadPoolStats stats() // thread-safe
+	{
+		ThreadPoolStats stats;
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		stats.Threads = m_Threads.size();
+		stats.Busy = m_Busy;
+		stats.Queued = m_Queue.size();
+		stats.Completed = m_Completed;
+		stats.PeakThreads = m_PeakThreads;
+		stats.PeakQueued = m_PeakQueued;
+		return stats;
+	}
+
+private:
+	static size_t defaultThreads()
+	{
+		size_t n = std::thread::hardware_concurrency();
+		return n ? n : 4;
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		for (;;)
+		{
+			if (m_Queue.empty())
+			{
+				if (m_Stopping)
+					return;
+				++m_Idle;
+				m_Cond.wait(lock);
+				--m_Idle;
+				continue;
+			}
+			EventTask f = std::move(m_Queue.front());
+			m_Queue.pop_front();
+			++m_Busy;
+			lock.unlock();
+			f();
+			f.reset();
+			lock.lock();
+			--m_Busy;
+			++m_Completed;
+		}
+	}
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Cond;
+	std::deque<EventTask> m_Queue;
+	std::vector<std::thread> m_Threads;
+	size_t m_MaxThreads;
+	size_t m_Idle;
+	size_t m_Busy;
+	uint64_t m_Completed;
+	size_t m_PeakThreads;
+	size_t m_PeakQueued;
+	bool m_Stopping;
+
+	ThreadPool &operator=(const ThreadPool&) = delete;
+	ThreadPool(const ThreadPool&) = delete;
+
+};
+
+#endif /* THREADUTIL_THREAD_POOL_H */
+
+/* end of file */
@@ -0,0 +1,475 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_TIMER_WHEEL_H
+#define THREADUTIL_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include "event_task.h"
+
+//! Hierarchical timing wheel with 1ms ticks. Insert, erase and expiry of a timer are O(1). Not thread-safe
+//! Four levels of 256 slots cover about 49 days, timers further out are cascaded again when they come in range
+//! A timer with slack may fire up to that much later, it is moved onto the most aligned tick within its window so nearby timers share a wakeup
+class TimerWheel
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::milliseconds Tick;
+
+	//! Identifies a timer, remains valid across repeats of an interval until it is erased or released
+	struct Handle
+	{
+	public:
+		inline Handle() : Index(0), Generation(0) { }
+		inline bool operator ==(const Handle &o) const { return Index == o.Index && Generation == o.Generation; }
+		inline bool operator !=(const Handle &o) const { return !(*this == o); }
+
+		//! Unique number for this timer, for example to identify it in a trace
+		inline uint64_t key() const { return ((uint64_t)Generation << 32) | Index; }
+
+	private:
+		friend class TimerWheel;
+		inline Handle(uint32_t index, uint32_t generation) : Index(index), Generation(generation) { }
+		uint32_t Index;
+		uint32_t Generation;
+	};
+
+	inline TimerWheel() : m_Base(Clock::now()), m_Tick(0), m_Size(0), m_Free(NoIndex), m_Fired(0), m_Coalesced(0), m_WakeupsSaved(0)
+	{
+		for (int l = 0; l < Levels; ++l)
+		{
+			m_Count[l] = 0;
+			for (int s = 0; s < Slots; ++s)
+				m_Lists[l][s].Head = m_Lists[l][s].Tail = NoIndex;
+		}
+		m_Expired.Head = m_Expired.Tail = NoIndex;
+	}
+
+	//! Number of timers, including running ones
+	inline size_t size() const { return m_Size; }
+	inline bool empty() const { return !m_Size; }
+
+	Handle insert(EventTask &&task, const Clock::time_point &time, const Clock::duration &interval, const Clock::duration &slack = Clock::duration::zero())
+	{
+		uint32_t index = m_Free;
+		if (index == NoIndex)
+		{
+			index = (uint32_t)m_Nodes.size();
+			m_Nodes.push_back(Node());
+		}
+		else
+		{
+			m_Free = m_Nodes[index].Next;
+		}
+		Node &node = m_Nodes[index];
+		node.Task = std::move(task);
+		node.Time = time;
+		node.Interval = interval;
+		node.Slack = slack;
+		++m_Size;
+		schedule(index);
+		return Handle(index, node.Generation);
+	}
+
+	//! Remove a timer, moving its function out so it can be destroyed outside of any lock. Returns false if the handle is no longer valid
+	bool erase(const Handle &handle, EventTask &task)
+	{
+		if (!valid(handle))
+			return false;
+		Node &node = m_Nodes[handle.Index];
+		if (node.List != Running)
+			unlink(handle.Index);
+		task = std::move(node.Task);
+		free(handle.Index);
+		return true;
+	}
+
+	//! Move out the function of the next timer that is due, the timer is running until it is repeated or released
+	bool expire(const Clock::time_point &now, Handle &handle, EventTask &task)
+	{
+		if (m_Expired.Head == NoIndex)
+		{
+			if (now < m_Base)
+				return false;
+			advance((uint64_t)std::chrono::duration_cast<Tick>(now - m_Base).count());
+			if (m_Expired.Head == NoIndex)
+				return false;
+		}
+		uint32_t index = m_Expired.Head;
+		unlink(index);
+		Node &node = m_Nodes[index];
+		node.List = Running;
+		task = std::move(node.Task);
+		handle = Handle(index, node.Generation);
+		return true;
+	}
+
+	//! Time at which a running timer was due, before any slack
+	inline const Clock::time_point &time(const Handle &handle) const
+	{
+		return m_Nodes[handle.Index].Time;
+	}
+
+	//! Reschedule a running interval timer with its function. Releases the timer and returns false when it is not an interval, or when it was erased while running
+	bool repeat(const Handle &handle, EventTask &task)
+	{
+		if (!valid(handle))
+			return false;
+		Node &node = m_Nodes[handle.Index];
+		if (node.List != Running)
+			return false;
+		if (node.Interval <= Clock::duration::zero())
+		{
+			free(handle.Index);
+			return false;
+		}
+		node.Task = std::move(task);
+		node.Time += node.Interval;
+		schedule(handle.Index);
+		return true;
+	}
+
+	//! Release a running timer without repeating it
+	void release(const Handle &handle)
+	{
+		if (valid(handle) && m_Nodes[handle.Index].List == Running)
+			free(handle.Index);
+	}
+
+	//! Earliest time at which a timer may be due, returns false when there are no pending timers
+	bool next(Clock::time_point &time) const
+	{
+		if (m_Expired.Head != NoIndex)
+		{
+			time = m_Base; // Due now
+			return true;
+		}
+		uint64_t best = UINT64_MAX;
+		if (m_Count[0])
+		{
+			for (uint64_t k = 0; k < Slots; ++k)
+			{
+				if (m_Lists[0][(m_Tick + k) & Mask].Head != NoIndex)
+				{
+					best = m_Tick + k;
+					break;
+				}
+			}
+		}
+		for (int l = 1; l < Levels; ++l)
+		{
+			if (!m_Count[l])
+				continue;
+			int shift = l * Bits;
+			uint64_t current = m_Tick >> shift;
+			uint64_t first = (current << shift) < m_Tick ? 1 : 0; // The current slot is still pending when the next tick is its boundary
+			for (uint64_t k = first; k < first + Slots; ++k)
+			{
+				if (m_Lists[l][(current + k) & Mask].Head != NoIndex)
+				{
+					uint64_t boundary = (current + k) << shift; // Cascades at this tick
+					if (boundary < best)
+						best = boundary;
+					break;
+				}
+			}
+		}
+		if (best == UINT64_MAX)
+			return false;
+		time = m_Base + Tick(best);
+		return true;
+	}
+
+	//! Drop all timers. Nodes are kept and their generation bumped, so handles from before the clear stay invalid
+	void clear()
+	{
+		for (uint32_t index = 0; index < (uint32_t)m_Nodes.size(); ++index)
+		{
+			if (m_Nodes[index].List != Free)
+			{
+				m_Nodes[index].Prev = m_Nodes[index].Next = NoIndex;
+				free(index);
+			}
+		}
+		for (int l = 0; l < Levels; ++l)
+		{
+			m_Count[l] = 0;
+			for (int s = 0; s < Slots; ++s)
+				m_Lists[l][s].Head = m_Lists[l][s].Tail = NoIndex;
+		}
+		m_Expired.Head = m_Expired.Tail = NoIndex;
+	}
+
+	//! Number of timers that expired
+	inline uint64_t fired() const { return m_Fired; }
+
+	//! Number of timers that were moved later within their slack to share a tick with other timers
+	inline uint64_t coalesced() const { return m_Coalesced; }
+
+	//! Number of distinct ticks that did not need their own wakeup because their timers were coalesced
+	inline uint64_t wakeupsSaved() const { return m_WakeupsSaved; }
+
+private:
+	enum
+	{
+		Bits = 8,
+		Slots = 1 << Bits,
+		Mask = Slots - 1,
+		Levels = 4,
+	};
+
+	static const uint32_t NoIndex = 0xFFFFFFFF;
+	static const uint32_t Running = 0xFFFFFFFE; // List id of a node that is expired but not yet repeated or released
+	static const uint32_t Free = 0xFFFFFFFD;
+	static const uint32_t Expired = 0xFFFFFFFC;
+
+	struct Node
+	{
+	public:
+		Node() : Interval(Clock::duration::zero()), Slack(Clock::duration::zero()), Expiry(0), Exact(0), Prev(NoIndex), Next(NoIndex), List(Free), Generation(1) { }
+		EventTask Task;
+		Clock::time_point Time;
+		Clock::duration Interval;
+		Clock::duration Slack;
+		uint64_t Expiry; // Tick at which the timer fires
+		uint64_t Exact; // Tick without slack
+		uint32_t Prev;
+		uint32_t Next;
+		uint32_t List;
+		uint32_t Generation;
+	};
+
+	struct List
+	{
+		uint32_t Head;
+		uint32_t Tail;
+	};
+
+	inline bool valid(const Handle &handle) const
+	{
+		return handle.Index < m_Nodes.size()
+			&& m_Nodes[handle.Index].Generation == handle.Generation
+			&& m_Nodes[handle.Index].List != Free;
+	}
+
+	inline List &list(uint32_t id)
+	{
+		return id == Expired ? m_Expired : m_Lists[id >> Bits][id & Mask];
+	}
+
+	inline void free(uint32_t index)
+	{
+		Node &node = m_Nodes[index];
+		node.Task.reset();
+		node.List = Free;
+		if (!++node.Generation)
+			node.Generation = 1;
+		node.Next = m_Free;
+		m_Free = index;
+		--m_Size;
+	}
+
+	inline void link(uint32_t index, uint32_t id)
+	{
+		Node &node = m_Nodes[index];
+		List &l = list(id);
+		node.List = id;
+		node.Prev = l.Tail;
+		node.Next = NoIndex;
+		if (l.Tail != NoIndex)
+			m_Nodes[l.Tail].Next = index;
+		else
+			l.Head = index;
+		l.Tail = index;
+		if (id != Expired)
+			++m_Count[id >> Bits];
+	}
+
+	inline void unlink(uint32_t index)
+	{
+		Node &node = m_Nodes[index];
+		List &l = list(node.List);
+		if (node.Prev != NoIndex)
+			m_Nodes[node.Prev].Next = node.Next;
+		else
+			l.Head = node.Next;
+		if (node.Next != NoIndex)
+			m_Nodes[node.Next].Prev = node.Prev;
+		else
+			l.Tail = node.Prev;
+		if (node.List != Expired)
+			--m_Count[node.List >> Bits];
+		node.Prev = node.Next = NoIndex;
+	}
+
+	//! Tick at which the node expires, rounded up so it never fires early
+	inline uint64_t tickOf(const Clock::time_point &time) const
+	{
+		if (time <= m_Base)
+			return 0;
+		Clock::duration delta = time - m_Base;
+		uint64_t tick = (uint64_t)std::chrono::duration_cast<Tick>(delta).count();
+		if (Tick(tick) < delta)
+			++tick;
+		return tick;
+	}
+
+	inline void schedule(uint32_t index)
+	{
+		Node &node = m_Nodes[index];
+		node.Exact = tickOf(node.Time);
+		node.Expiry = node.Exact;
+		if (node.Slack >= Tick(1))
+		{
+			// Pick the tick with the most trailing zero bits within the slack window
+			uint64_t limit = node.Exact + (uint64_t)std::chrono::duration_cast<Tick>(node.Slack).count();
+			uint64_t mask = node.Exact ^ limit;
+			int bit = 63;
+			while (!(mask & ((uint64_t)1 << bit)))
+				--bit;
+			node.Expiry = limit & ~(((uint64_t)1 << bit) - 1);
+		}
+		place(index);
+	}
+
+	//! Link the node into the slot matching its tick, relative to the current tick
+	inline void place(uint32_t index)
+	{
+		uint64_t tick = m_Nodes[index].Expiry;
+		if (tick < m_Tick)
+			tick = m_Tick; // Already due, process at the next advance
+		uint64_t delta = tick - m_Tick;
+		int level = 0;
+		while (level < Levels - 1 && delta >= ((uint64_t)1 << (Bits * (level + 1))))
+			++level;
+		if (level == Levels - 1 && delta >= ((uint64_t)1 << (Bits * Levels)))
+			tick = m_Tick + ((uint64_t)1 << (Bits * Levels)) - 1; // Out of range, cascaded again later
+		link(index, (uint32_t)((level << Bits) | ((tick >> (level * Bits)) & Mask)));
+	}
+
+	//! Move the timers of the current slot at the given level down
+	void cascade(int level)
+	{
+		uint32_t slot = (uint32_t)((m_Tick >> (level * Bits)) & Mask);
+		if (!slot && level + 1 < Levels)
+			cascade(level + 1);
+		List &l = m_Lists[level][slot];
+		uint32_t index = l.Head;
+		m_Count[level] -= countList(index);
+		l.Head = l.Tail = NoIndex;
+		while (index != NoIndex)
+		{
+			uint32_t next = m_Nodes[index].Next;
+			place(index);
+			index = next;
+		}
+	}
+
+	inline uint32_t countList(uint32_t index) const
+	{
+		uint32_t count = 0;
+		for (; index != NoIndex; index = m_Nodes[index].Next)
+			++count;
+		return count;
+	}
+
+	//! Process all ticks up to and including the given tick, moving due timers to the expired list
+	void advance(uint64_t tick)
+	{
+		while (m_Tick <= tick)
+		{
+			if (!scheduled())
+			{
+				m_Tick = tick + 1; // Nothing scheduled
+				return;
+			}
+			if (!(m_Tick & Mask))
+				cascade(1);
+			List &l = m_Lists[0][m_Tick & Mask];
+			uint32_t index = l.Head;
+			while (index != NoIndex)
+			{
+				Node &node = m_Nodes[index];
+				uint32_t next = node.Next;
+				++m_Fired;
+				if (node.Exact < m_Tick && node.Expiry == m_Tick)
+				{
+					++m_Coalesced;
+					m_Exact.push_back(node.Exact);
+				}
+				unlink(index);
+				link(index, Expired);
+				index = next;
+			}
+			if (!m_Exact.empty())
+			{
+				// Each distinct tick that was pulled into this one would otherwise have been a separate wakeup
+				std::sort(m_Exact.begin(), m_Exact.end());
+				m_WakeupsSaved += std::unique(m_Exact.begin(), m_Exact.end()) - m_Exact.begin();
+				m_Exact.clear();
+			}
+			++m_Tick;
+			if (!m_Count[0] && (m_Tick & Mask))
+			{
+				uint64_t boundary = (m_Tick | Mask) + 1; // Level 0 is empty, skip ahead to the next cascade
+				m_Tick = boundary > tick ? tick + 1 : boundary;
+			}
+		}
+	}
+
+	inline uint32_t scheduled() const
+	{
+		uint32_t count = 0;
+		for (int l = 0; l < Levels; ++l)
+			count += m_Count[l];
+		return count;
+	}
+
+	Clock::time_point m_Base;
+	uint64_t m_Tick; // Next tick to process
+	size_t m_Size;
+	uint32_t m_Free;
+	uint32_t m_Count[Levels];
+	List m_Lists[Levels][Slots];
+	List m_Expired;
+	std::vector<Node> m_Nodes;
+	std::vector<uint64_t> m_Exact; // Scratch
+
+	uint64_t m_Fired;
+	uint64_t m_Coalesced;
+	uint64_t m_WakeupsSaved;
+
+};
+
+#endif /* THREADUTIL_TIMER_WHEEL_H */
+
+/* end of file */
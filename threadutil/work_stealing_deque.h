@@ -0,0 +1,154 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_WORK_STEALING_DEQUE_H
+#define THREADUTIL_WORK_STEALING_DEQUE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+//! Chase-Lev work stealing deque of pointers. The owner thread pushes and takes at the bottom, other threads steal from the top
+//! Follows the C11 formulation by Le, Pop, Cohen and Zappa Nardelli. Grown buffers are kept until destruction, since thieves may still read them
+template<class T>
+class WorkStealingDeque
+{
+public:
+	WorkStealingDeque(int64_t capacity = 256) : m_Top(0), m_Bottom(0)
+	{
+		Array *a = new Array(capacity);
+		m_Array.store(a, std::memory_order_relaxed);
+		m_Arrays.push_back(a);
+	}
+
+	~WorkStealingDeque()
+	{
+		for (size_t i = 0; i < m_Arrays.size(); ++i)
+			delete m_Arrays[i];
+	}
+
+	//! Only call from the owner thread
+	void push(T *value)
+	{
+		int64_t b = m_Bottom.load(std::memory_order_relaxed);
+		int64_t t = m_Top.load(std::memory_order_acquire);
+		Array *a = m_Array.load(std::memory_order_relaxed);
+		if (b - t > a->Size - 1)
+			a = grow(a, b, t);
+		a->put(b, value);
+		m_Bottom.store(b + 1, std::memory_order_release);
+	}
+
+	//! Only call from the owner thread, returns NULL when empty
+	T *take()
+	{
+		int64_t b = m_Bottom.load(std::memory_order_relaxed) - 1;
+		Array *a = m_Array.load(std::memory_order_relaxed);
+		m_Bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = m_Top.load(std::memory_order_relaxed);
+		T *value = NULL;
+		if (t <= b)
+		{
+			value = a->get(b);
+			if (t == b)
+			{
+				// Last element, race against thieves
+				if (!m_Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					value = NULL;
+				m_Bottom.store(b + 1, std::memory_order_relaxed);
+			}
+		}
+		else
+		{
+			m_Bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return value;
+	}
+
+	//! Thread-safe, returns NULL when empty or when losing a race with another thief or the owner
+	T *steal()
+	{
+		int64_t t = m_Top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = m_Bottom.load(std::memory_order_acquire);
+		if (t < b)
+		{
+			Array *a = m_Array.load(std::memory_order_acquire);
+			T *value = a->get(t);
+			if (!m_Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return NULL;
+			return value;
+		}
+		return NULL;
+	}
+
+	//! Approximate, thread-safe
+	inline bool empty() const
+	{
+		int64_t t = m_Top.load(std::memory_order_acquire);
+		int64_t b = m_Bottom.load(std::memory_order_acquire);
+		return b <= t;
+	}
+
+private:
+	struct Array
+	{
+	public:
+		Array(int64_t size) : Size(size), Buffer(new std::atomic<T *>[size]) { }
+		~Array() { delete[] Buffer; }
+		inline T *get(int64_t i) const { return Buffer[i & (Size - 1)].load(std::memory_order_relaxed); }
+		inline void put(int64_t i, T *value) { Buffer[i & (Size - 1)].store(value, std::memory_order_relaxed); }
+		int64_t Size; // Power of two
+		std::atomic<T *> *Buffer;
+	};
+
+	Array *grow(Array *a, int64_t b, int64_t t)
+	{
+		Array *na = new Array(a->Size * 2);
+		for (int64_t i = t; i < b; ++i)
+			na->put(i, a->get(i));
+		m_Arrays.push_back(na);
+		m_Array.store(na, std::memory_order_release);
+		return na;
+	}
+
+	std::atomic<int64_t> m_Top;
+	char m_Padding[64 - sizeof(std::atomic<int64_t>)];
+	std::atomic<int64_t> m_Bottom;
+	std::atomic<Array *> m_Array;
+	std::vector<Array *> m_Arrays; // Owner only
+
+	WorkStealingDeque &operator=(const WorkStealingDeque&) = delete;
+	WorkStealingDeque(const WorkStealingDeque&) = delete;
+
+};
+
+#endif /* THREADUTIL_WORK_STEALING_DEQUE_H */
+
+/* end of file */
@@ -0,0 +1,317 @@
+/*
+
+Copyright (C) 2017  by authors
+Author: Jan Boon <jan.boon@kaetemi.be>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef THREADUTIL_WORK_STEALING_EXECUTOR_H
+#define THREADUTIL_WORK_STEALING_EXECUTOR_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "event_loop.h"
+#include "atomic_lock.h"
+#include "block_pool.h"
+#include "work_stealing_deque.h"
+
+//! Multi-threaded executor for functions without ordering requirements, with the immediate and timeout calls of EventLoop
+//! Each worker has its own work stealing deque. Functions posted from a worker stay on that worker, others go through a shared injection queue, and idle workers steal
+//! Unlike EventLoop, functions may run concurrently and in any order. Timers are kept by an internal EventLoop which posts them here when due
+class WorkStealingExecutor
+{
+public:
+	//! Creates one worker per core when size is zero
+	WorkStealingExecutor(size_t size = 0) : m_Running(false), m_Sleepers(0), m_Pending(0), m_Joiners(0)
+	{
+		if (!size)
+			size = std::thread::hardware_concurrency();
+		if (!size)
+			size = 1;
+		for (size_t i = 0; i < size; ++i)
+			m_Workers.push_back(std::unique_ptr<Worker>(new Worker()));
+	}
+
+	~WorkStealingExecutor()
+	{
+		stop();
+		m_Timer.stop();
+		m_Timer.clear();
+		EventTask *task;
+		while ((task = popInjected()))
+			deleteTask(task);
+		for (size_t i = 0; i < m_Workers.size(); ++i)
+			while ((task = m_Workers[i]->Deque.steal()))
+				deleteTask(task);
+	}
+
+	void run()
+	{
+		stop();
+		m_Running = true;
+		for (size_t i = 0; i < m_Workers.size(); ++i)
+			m_Workers[i]->Thread = std::thread(&WorkStealingExecutor::worker, this, i);
+		m_Timer.run();
+	}
+
+	//! Stops the workers, functions that are still queued remain queued until the next run
+	void stop() // thread-safe
+	{
+		m_Running = false;
+		; {
+			std::unique_lock<std::mutex> lock(m_SleepLock);
+			m_SleepCond.notify_all();
+		}
+		; {
+			std::unique_lock<std::mutex> lock(m_JoinLock);
+			m_JoinCond.notify_all();
+		}
+		for (size_t i = 0; i < m_Workers.size(); ++i)
+			if (m_Workers[i]->Thread.joinable())
+				m_Workers[i]->Thread.join();
+	}
+
+	//! Block until no functions are pending, including the ones posted by running functions. Timers that are not yet due are not waited for
+	//! Returns early when the executor is stopped, or right away when it is not running
+	void join() // thread-safe
+	{
+		std::unique_lock<std::mutex> lock(m_JoinLock);
+		m_Joiners.fetch_add(1, std::memory_order_seq_cst);
+		while (m_Running && m_Pending.load(std::memory_order_seq_cst))
+			m_JoinCond.wait(lock);
+		m_Joiners.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	inline size_t size() const { return m_Workers.size(); }
+
+public:
+	template<class TFunc> void immediate(TFunc &&f) // thread-safe
+	{
+		submit(newTask(std::forward<TFunc>(f)));
+	}
+
+	template<class TFunc, class rep, class period> EventTimer timeout(TFunc &&f, const std::chrono::duration<rep, period>& delta) // thread-safe
+	{
+		return m_Timer.timeout(Forward(this, newTask(std::forward<TFunc>(f))), delta);
+	}
+
+	//! The function may run concurrently with its previous call if that one takes longer than the interval. Use clear to stop it
+	template<class TFunc, class rep, class period> EventTimer interval(TFunc &&f, const std::chrono::duration<rep, period>& interval) // thread-safe
+	{
+		std::shared_ptr<typename std::decay<TFunc>::type> shared(new typename std::decay<TFunc>::type(std::forward<TFunc>(f)));
+		return m_Timer.interval([this, shared]() -> void {
+			immediate([shared]() -> void { (*shared)(); });
+		}, interval);
+	}
+
+	template<class TFunc> EventTimer timed(TFunc &&f, const std::chrono::steady_clock::time_point &point) // thread-safe
+	{
+		return m_Timer.timed(Forward(this, newTask(std::forward<TFunc>(f))), point);
+	}
+
+	bool clear(const EventTimer &timer) // thread-safe
+	{
+		return m_Timer.clear(timer);
+	}
+
+private:
+	struct Worker
+	{
+		WorkStealingDeque<EventTask> Deque;
+		std::thread Thread;
+	};
+
+	struct Current
+	{
+		WorkStealingExecutor *Executor;
+		size_t Index;
+	};
+
+	//! Timer function that submits the task to the workers when due. Holds the task by pointer, so that it is stored inline by the timer
+	struct Forward
+	{
+	public:
+		Forward(WorkStealingExecutor *executor, EventTask *task) : Executor(executor), Task(task) { }
+		Forward(Forward &&other) noexcept : Executor(other.Executor), Task(other.Task) { other.Task = NULL; }
+		~Forward() { if (Task) Executor->deleteTask(Task); }
+		void operator()() { EventTask *task = Task; Task = NULL; Executor->submit(task); }
+		WorkStealingExecutor *Executor;
+		EventTask *Task;
+
+		Forward &operator=(const Forward&) = delete;
+		Forward(const Forward&) = delete;
+	};
+
+	static_assert(EventTask::fitsInline<Forward>(), "Forward must be stored inline by the timer");
+
+	static Current &current()
+	{
+		static thread_local Current c = { NULL, 0 };
+		return c;
+	}
+
+	//! Tasks are kept in blocks of the executor's pool, so posting usually does not touch the heap
+	template<class TFunc> EventTask *newTask(TFunc &&f)
+	{
+		return new (m_BlockPool.allocate(sizeof(EventTask))) EventTask(std::forward<TFunc>(f));
+	}
+
+	void deleteTask(EventTask *task)
+	{
+		task->~EventTask();
+		m_BlockPool.deallocate(task, sizeof(EventTask));
+	}
+
+	void submit(EventTask *task)
+	{
+		m_Pending.fetch_add(1, std::memory_order_relaxed);
+		Current &c = current();
+		if (c.Executor == this)
+		{
+			m_Workers[c.Index]->Deque.push(task); // Stay local
+		}
+		else
+		{
+			std::unique_lock<AtomicLock> lock(m_InjectLock);
+			m_Inject.push_back(task);
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_Sleepers.load(std::memory_order_relaxed))
+		{
+			std::unique_lock<std::mutex> lock(m_SleepLock);
+			m_SleepCond.notify_one();
+		}
+	}
+
+	EventTask *popInjected()
+	{
+		std::unique_lock<AtomicLock> lock(m_InjectLock);
+		if (m_Inject.empty())
+			return NULL;
+		EventTask *task = m_Inject.front();
+		m_Inject.pop_front();
+		return task;
+	}
+
+	EventTask *find(size_t index, uint32_t &seed)
+	{
+		EventTask *task = m_Workers[index]->Deque.take();
+		if (task)
+			return task;
+		task = popInjected();
+		if (task)
+			return task;
+		size_t count = m_Workers.size();
+		seed = seed * 1103515245 + 12345;
+		size_t start = (seed >> 16) % count;
+		for (size_t i = 0; i < count; ++i)
+		{
+			size_t victim = (start + i) % count;
+			if (victim == index)
+				continue;
+			task = m_Workers[victim]->Deque.steal();
+			if (task)
+				return task;
+		}
+		return NULL;
+	}
+
+	bool hasWork()
+	{
+		; {
+			std::unique_lock<AtomicLock> lock(m_InjectLock);
+			if (!m_Inject.empty())
+				return true;
+		}
+		for (size_t i = 0; i < m_Workers.size(); ++i)
+			if (!m_Workers[i]->Deque.empty())
+				return true;
+		return false;
+	}
+
+	void worker(size_t index)
+	{
+		Current &c = current();
+		c.Executor = this;
+		c.Index = index;
+		uint32_t seed = (uint32_t)index + 1;
+		int idle = 0;
+		while (m_Running)
+		{
+			EventTask *task = find(index, seed);
+			if (task)
+			{
+				idle = 0;
+				(*task)();
+				deleteTask(task);
+				if (m_Pending.fetch_sub(1, std::memory_order_seq_cst) == 1 && m_Joiners.load(std::memory_order_seq_cst))
+				{
+					std::unique_lock<std::mutex> lock(m_JoinLock);
+					m_JoinCond.notify_all();
+				}
+				continue;
+			}
+			if (++idle < 64)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			idle = 0;
+			std::unique_lock<std::mutex> lock(m_SleepLock);
+			m_Sleepers.fetch_add(1, std::memory_order_seq_cst);
+			if (m_Running && !hasWork())
+				m_SleepCond.wait(lock);
+			m_Sleepers.fetch_sub(1, std::memory_order_relaxed);
+		}
+		c.Executor = NULL;
+	}
+
+	BlockPool m_BlockPool; // Declared first, so that it outlives anything holding tasks
+	std::vector<std::unique_ptr<Worker> > m_Workers;
+	AtomicLock m_InjectLock;
+	std::deque<EventTask *> m_Inject;
+	std::atomic_bool m_Running;
+	std::mutex m_SleepLock;
+	std::condition_variable m_SleepCond;
+	std::atomic<int> m_Sleepers;
+	std::atomic<size_t> m_Pending;
+	std::mutex m_JoinLock;
+	std::condition_variable m_JoinCond;
+	std::atomic<int> m_Joiners;
+	EventLoop m_Timer;
+
+	WorkStealingExecutor &operator=(const WorkStealingExecutor&) = delete;
+	WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+
+};
+
+#endif /* THREADUTIL_WORK_STEALING_EXECUTOR_H */
+
+/* end of file */